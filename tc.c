@@ -56,7 +56,22 @@ enum options
   OPTION_FP_DOUBLE_FORMAT,
   OPTION_COMPAT_LL_PREFIX,
   OPTION_COMPAT_COLONLESS,
-  OPTION_COMPAT_SDCC
+  OPTION_COMPAT_SDCC,
+  OPTION_IMAGE,
+  OPTION_IMAGE_FORMAT,
+  OPTION_IMAGE_ORIGIN,
+  OPTION_STATS,
+  OPTION_SIZE_REPORT,
+  OPTION_ENCODE_CACHE,
+  OPTION_CHECK_MARCH,
+  OPTION_AUTO_SUFFIX,
+  OPTION_WARN_LIMIT,
+  OPTION_INDEX_FOLD,
+  OPTION_UNREACHABLE,
+  OPTION_FUSE_CALL_RET,
+  OPTION_SYNTHETIC,
+  OPTION_FAR_PORT,
+  OPTION_FAR_SHADOW
 };
 
 #define INS_Z80      (1 << 0)
@@ -111,6 +126,21 @@ const struct option md_longopts[] =
   { "Wup",  no_argument, NULL, OPTION_MACH_WUP },
   { "forbid-unportable-instructions", no_argument, NULL, OPTION_MACH_FUP },
   { "Fup",  no_argument, NULL, OPTION_MACH_FUP },
+  { "image", required_argument, NULL, OPTION_IMAGE },
+  { "image-format", required_argument, NULL, OPTION_IMAGE_FORMAT },
+  { "image-origin", required_argument, NULL, OPTION_IMAGE_ORIGIN },
+  { "z80-stats", optional_argument, NULL, OPTION_STATS },
+  { "z80-size-report", no_argument, NULL, OPTION_SIZE_REPORT },
+  { "encode-cache", required_argument, NULL, OPTION_ENCODE_CACHE },
+  { "check-march", required_argument, NULL, OPTION_CHECK_MARCH },
+  { "auto-suffix", no_argument, NULL, OPTION_AUTO_SUFFIX },
+  { "warn-limit", required_argument, NULL, OPTION_WARN_LIMIT },
+  { "index-fold", required_argument, NULL, OPTION_INDEX_FOLD },
+  { "unreachable", required_argument, NULL, OPTION_UNREACHABLE },
+  { "fuse-call-ret", no_argument, NULL, OPTION_FUSE_CALL_RET },
+  { "synthetic", no_argument, NULL, OPTION_SYNTHETIC },
+  { "far-port", required_argument, NULL, OPTION_FAR_PORT },
+  { "far-shadow", required_argument, NULL, OPTION_FAR_SHADOW },
 
   { NULL, no_argument, NULL, 0 }
 } ;
@@ -122,6 +152,13 @@ extern int coff_flags;
 static int ins_ok = INS_Z80 | INS_UNDOC;
 /* Instruction classes that generate errors.  */
 static int ins_err = ~(INS_Z80 | INS_UNDOC);
+/* Instruction classes in INS_OK that generate warnings.  */
+static int ins_warn = 0;
+/* ISA gate derived from the above by setup_isa_gate: classes assembled
+   silently and classes assembled with a warning; any other class is an
+   error.  */
+static int gate_silent;
+static int gate_warn;
 /* eZ80 CPU mode (ADL or Z80) */
 static int cpu_mode = 0; /* 0 - Z80, 1 - ADL */
 /* accept SDCC specific instruction encoding */
@@ -134,6 +171,119 @@ static const char *local_label_prefix = NULL;
 typedef const char *(*str_to_float_t)(char *litP, int *sizeP);
 static str_to_float_t str_to_float;
 static str_to_float_t str_to_double;
+/* direct image output (NULL - none) */
+enum image_format
+{
+  IMAGE_BINARY,
+  IMAGE_IHEX,
+  IMAGE_SNA,
+  IMAGE_TAP,
+  IMAGE_GB
+};
+static const char *image_file = NULL;
+static enum image_format image_format = IMAGE_BINARY;
+static addressT image_origin = 0;
+/* hot path statistics (see -z80-stats) */
+enum stats_format
+{
+  STATS_NONE,
+  STATS_TEXT,
+  STATS_JSON
+};
+static enum stats_format stats_format = STATS_NONE;
+enum z80_stat
+{
+  STAT_START_LINE_HOOK,
+  STAT_MD_ASSEMBLE,
+  STAT_PARSE_EXP,
+  STAT_CONTAINS_REGISTER,
+  STAT_EMIT_DATA,
+  STAT_DATA_FIXUPS,
+  STAT_APPLY_FIX,
+  STAT_GEN_RELOC,
+  STAT_MAX
+};
+static const char *const stat_names[STAT_MAX] =
+{
+  "start_line_hook",
+  "md_assemble",
+  "parse_exp",
+  "contains_register",
+  "emit_data",
+  "data_fixups",
+  "md_apply_fix",
+  "tc_gen_reloc"
+};
+static unsigned long stat_counts[STAT_MAX];
+/* print instruction size attribution (see -z80-size-report) */
+static int size_report = 0;
+/* persistent encoding cache file (NULL - none) */
+static const char *encode_cache_file = NULL;
+/* additional CPUs every instruction is checked against (see -check-march) */
+struct check_target
+{
+  const char *name;
+  int ins_ok;
+  int failed; /* the current instruction is not supported */
+  unsigned long failures;
+};
+static struct check_target *check_targets;
+static unsigned check_target_count;
+/* add eZ80 mode suffixes to cross-mode call/jp (see -auto-suffix) */
+static int auto_suffix = 0;
+/* frequent warnings, counted per kind and rate limited (see -warn-limit) */
+enum diag_kind
+{
+  DIAG_UNDOC,
+  DIAG_UNPORT,
+  DIAG_UNSUPPORTED,
+  DIAG_PARENS,
+  DIAG_OVERFLOW,
+  DIAG_NOP,
+  DIAG_CHECK_MARCH,
+  DIAG_INDEX_FOLD,
+  DIAG_CALL_RET,
+  DIAG_MAX
+};
+static const char *const diag_names[DIAG_MAX] =
+{
+  "undocumented instruction",
+  "unportable instruction",
+  "unsupported instruction",
+  "parentheses ignored",
+  "overflow",
+  "assembled as NOP",
+  "check-march",
+  "index-fold",
+  "fuse-call-ret"
+};
+static unsigned long warn_limit = 0; /* 0 - no limit */
+/* pairs of 8-bit (ix+d) accesses to one 16-bit slot (see -index-fold) */
+enum index_fold
+{
+  INDEX_FOLD_NONE,
+  INDEX_FOLD_REPORT,
+  INDEX_FOLD_REWRITE
+};
+static enum index_fold index_fold = INDEX_FOLD_NONE;
+/* instructions after an unconditional jump or return (see -unreachable) */
+enum unreachable_mode
+{
+  UNREACHABLE_NONE,
+  UNREACHABLE_WARN,
+  UNREACHABLE_DROP
+};
+static enum unreachable_mode unreachable_mode = UNREACHABLE_NONE;
+/* turn call followed by ret into jp (see -fuse-call-ret) */
+static int fuse_call_ret = 0;
+/* accept 16-bit pseudo instructions (see -synthetic) */
+static int synthetic_insns = 0;
+/* I/O port selecting the bank for farcall/farjp, or -1 for the
+   CPU's default (see emit_far_trampolines) */
+static int far_port = -1;
+/* address of the byte mirroring the bank register, or -1 for the
+   CPU's default */
+static int far_shadow = -1;
 
 /* mode of current instruction */
 #define INST_MODE_S 0      /* short data mode */
@@ -176,6 +326,32 @@ match_ext_table [] =
 };
 
 
+struct reloc_desc;
+static const struct reloc_desc *get_reloc_desc (bfd_reloc_code_real_type);
+static void apply_relocation (fixS *fixP, const struct reloc_desc *desc,
+			      char *p_lit, long val);
+static void write_image (void);
+static void print_stats (void);
+static void print_size_report (void);
+static void load_encode_cache (void);
+static void save_encode_cache (void);
+static void report_check_targets (void);
+static void check_march_usable (void);
+static void report_diagnostics (void);
+static void record_label_mode (const char *name);
+static void check_label_modes (void);
+static void setup_isa_gate (void);
+static void build_cpu_instab (void);
+static void forget_last_insn (void);
+static int has_label (const char *s);
+static void end_unreachable (int at_label);
+static int unreachable_pending (void);
+static void keep_unreachable (void);
+static int is_insn_line (const char *s);
+static void emit_far_trampolines (void);
+static int get_suffix_index (const char *sbuf);
+static int get_instruction_value (int index);
+static void set_instruction_mode (int value);
 static int signed_overflow (signed long value, unsigned bitsize);
 static int unsigned_overflow (unsigned long value, unsigned bitsize);
 static int is_overflow (long value, unsigned bitsize);
@@ -284,6 +460,12 @@ str_to_zeda32 (char *litP, int *sizeP);
 static const char *
 str_to_float48 (char *litP, int *sizeP);
 static const char *
+str_to_mbf32 (char *litP, int *sizeP);
+static const char *
+str_to_mbf40 (char *litP, int *sizeP);
+static const char *
+str_to_ti_bcd (char *litP, int *sizeP);
+static const char *
 str_to_ieee754_h (char *litP, int *sizeP);
 static const char *
 str_to_ieee754_s (char *litP, int *sizeP);
@@ -299,6 +481,15 @@ get_str_to_float (const char *arg)
   if (strcasecmp (arg, "math48") == 0)
     return str_to_float48;
 
+  if (strcasecmp (arg, "mbf32") == 0)
+    return str_to_mbf32;
+
+  if (strcasecmp (arg, "mbf40") == 0)
+    return str_to_mbf40;
+
+  if (strcasecmp (arg, "tibcd") == 0)
+    return str_to_ti_bcd;
+
   if (strcasecmp (arg, "half") == 0)
     return str_to_ieee754_h;
 
@@ -314,6 +505,66 @@ get_str_to_float (const char *arg)
   return NULL;
 }
 
+static enum image_format
+get_image_format (const char *arg)
+{
+  if (strcasecmp (arg, "binary") == 0)
+    return IMAGE_BINARY;
+
+  if (strcasecmp (arg, "ihex") == 0)
+    return IMAGE_IHEX;
+
+  if (strcasecmp (arg, "sna") == 0)
+    return IMAGE_SNA;
+
+  if (strcasecmp (arg, "tap") == 0)
+    return IMAGE_TAP;
+
+  if (strcasecmp (arg, "gb") == 0)
+    return IMAGE_GB;
+
+  as_fatal (_("invalid image format `%s'"), arg);
+  return IMAGE_BINARY;
+}
+
+static addressT
+get_image_origin (const char *arg)
+{
+  char *end;
+  unsigned long origin = strtoul (arg, &end, 0);
+
+  if (*arg == 0 || *end != 0)
+    as_fatal (_("invalid image origin `%s'"), arg);
+
+  return origin;
+}
+
+static void
+setup_check_targets (const char *list)
+{
+  while (*list)
+    {
+      size_t len = strcspn (list, ",");
+      struct check_target *t;
+      int ins_err, mode = 0;
+
+      check_targets = XRESIZEVEC (struct check_target, check_targets,
+                                  check_target_count + 1);
+      t = &check_targets[check_target_count++];
+      t->name = xmemdup0 (list, len);
+      t->ins_ok = INS_Z80 | INS_UNDOC;
+      ins_err = ~(INS_Z80 | INS_UNDOC);
+      t->failed = 0;
+      t->failures = 0;
+      setup_march (t->name, &t->ins_ok, &ins_err, &mode);
+      if (t->ins_ok & INS_GBZ80)
+        as_fatal (_("-check-march cannot be used with the GBZ80"));
+      list += len;
+      if (*list == ',')
+        ++list;
+    }
+}
+
 static int extract_instruction_token(const char *start, char *buffer, int buffer_size)
 {
     const char *end = strchr(start, ',');
@@ -416,6 +667,10 @@ md_parse_option (int c, const char* arg)
         {
           ins_ok |= INS_UNDOC;
           ins_err &= ~INS_UNDOC;
+          if (c == OPTION_MACH_WUD)
+            ins_warn |= INS_UNDOC;
+          else
+            ins_warn &= ~INS_UNDOC;
         }
       break;
     case OPTION_MACH_WUP:
@@ -424,18 +679,24 @@ md_parse_option (int c, const char* arg)
         {
           ins_ok |= INS_UNDOC | INS_UNPORT;
           ins_err &= ~(INS_UNDOC | INS_UNPORT);
+          if (c == OPTION_MACH_WUP)
+            ins_warn |= INS_UNPORT;
+          else
+            ins_warn &= ~(INS_UNDOC | INS_UNPORT);
         }
       break;
     case OPTION_MACH_FUD:
       if ((ins_ok & (INS_R800 | INS_GBZ80)) == 0)
 	{
-	  ins_ok &= (INS_UNDOC | INS_UNPORT);
+	  ins_ok &= ~(INS_UNDOC | INS_UNPORT);
 	  ins_err |= INS_UNDOC | INS_UNPORT;
+	  ins_warn &= ~(INS_UNDOC | INS_UNPORT);
 	}
       break;
     case OPTION_MACH_FUP:
       ins_ok &= ~INS_UNPORT;
       ins_err |= INS_UNPORT;
+      ins_warn &= ~INS_UNPORT;
       break;
     case OPTION_COMPAT_LL_PREFIX:
       local_label_prefix = (arg && *arg) ? arg : NULL;
@@ -446,6 +707,86 @@ md_parse_option (int c, const char* arg)
     case OPTION_COMPAT_COLONLESS:
       colonless_labels = 1;
       break;
+    case OPTION_IMAGE:
+      image_file = arg;
+      break;
+    case OPTION_IMAGE_FORMAT:
+      image_format = get_image_format (arg);
+      break;
+    case OPTION_IMAGE_ORIGIN:
+      image_origin = get_image_origin (arg);
+      break;
+    case OPTION_STATS:
+      if (stats_format == STATS_NONE)
+        xatexit (print_stats);
+      if (arg == NULL)
+        stats_format = STATS_TEXT;
+      else if (strcasecmp (arg, "json") == 0)
+        stats_format = STATS_JSON;
+      else
+        as_fatal (_("invalid statistics format `%s'"), arg);
+      break;
+    case OPTION_SIZE_REPORT:
+      size_report = 1;
+      break;
+    case OPTION_ENCODE_CACHE:
+      encode_cache_file = arg;
+      break;
+    case OPTION_CHECK_MARCH:
+      setup_check_targets (arg);
+      break;
+    case OPTION_AUTO_SUFFIX:
+      auto_suffix = 1;
+      break;
+    case OPTION_INDEX_FOLD:
+      if (strcasecmp (arg, "report") == 0)
+        index_fold = INDEX_FOLD_REPORT;
+      else if (strcasecmp (arg, "rewrite") == 0)
+        index_fold = INDEX_FOLD_REWRITE;
+      else
+        as_fatal (_("invalid -index-fold mode `%s'"), arg);
+      break;
+    case OPTION_UNREACHABLE:
+      if (strcasecmp (arg, "warn") == 0)
+        unreachable_mode = UNREACHABLE_WARN;
+      else if (strcasecmp (arg, "drop") == 0)
+        unreachable_mode = UNREACHABLE_DROP;
+      else
+        as_fatal (_("invalid -unreachable mode `%s'"), arg);
+      break;
+    case OPTION_FUSE_CALL_RET:
+      fuse_call_ret = 1;
+      break;
+    case OPTION_SYNTHETIC:
+      synthetic_insns = 1;
+      break;
+    case OPTION_FAR_PORT:
+      {
+        char *end;
+
+        far_port = strtoul (arg, &end, 0);
+        if (end == arg || *end || far_port > 0xFF)
+          as_fatal (_("invalid far call port `%s'"), arg);
+      }
+      break;
+    case OPTION_FAR_SHADOW:
+      {
+        char *end;
+
+        far_shadow = strtoul (arg, &end, 0);
+        if (end == arg || *end || far_shadow > 0xFFFF)
+          as_fatal (_("invalid bank shadow address `%s'"), arg);
+      }
+      break;
+    case OPTION_WARN_LIMIT:
+      {
+        char *end;
+
+        warn_limit = strtoul (arg, &end, 0);
+        if (end == arg || *end)
+          as_fatal (_("invalid warning limit `%s'"), arg);
+      }
+      break;
     }
 
   return 1;
@@ -492,6 +833,65 @@ print_compatibility_options(FILE *f)
                 "  double\t\t  IEEE754 double precision (64 bit)\n"
                 "  zeda32\t\t  Zeda z80float library 32 bit format\n"
                 "  math48\t\t  48 bit format from Math48 library\n"
+                "  mbf32\t\t\t  Microsoft Binary Format, 32 bit\n"
+                "  mbf40\t\t\t  Microsoft Binary Format, 40 bit\n"
+                "  tibcd\t\t\t  TI-83/84 Plus 9 byte BCD format\n"
+                "\n"
+                "Image output options:\n"
+                "  -image=FILE\t\t  also write an absolute image to FILE\n"
+                "  -image-format=FORMAT\t  set image format, one of:\n"
+                "  binary\t\t  raw binary (default)\n"
+                "  ihex\t\t\t  Intel HEX\n"
+                "  sna\t\t\t  ZX Spectrum 48K snapshot\n"
+                "  tap\t\t\t  ZX Spectrum tape with a CODE block\n"
+                "  gb\t\t\t  GameBoy ROM with header checksums\n"
+                "  -image-origin=ADDR\t  load address of the first image byte\n"
+                "\n"
+                "Statistics options:\n"
+                "  -z80-stats[=json]\t  print hot path and instruction counters\n"
+                "  -z80-size-report\t  print instruction bytes per mnemonic,\n"
+                "\t\t\t  prefix, suffix and source file\n"
+                "\n"
+                "Incremental assembly options:\n"
+                "  -encode-cache=FILE\t  reuse encodings of unchanged lines\n"
+                "\t\t\t  stored in FILE\n"
+                "  -check-march=CPU[,CPU...]\n"
+                "\t\t\t  also report instructions unsupported by CPU;\n"
+                "\t\t\t  checks mnemonics and the instruction classes\n"
+                "\t\t\t  of -march, not eZ80 or Z80N operand forms\n"
+                "\t\t\t  such as ld (ix+d),rr or push nn; not\n"
+                "\t\t\t  available for or with the GBZ80\n"
+                "\n"
+                "eZ80 mode options:\n"
+                "  -auto-suffix\t\t  add .IL/.IS/.LIL/.SIS to call and jp whose\n"
+                "\t\t\t  target label is in the other ADL mode\n"
+                "\n"
+                "Diagnostic options:\n"
+                "  -warn-limit=N\t\t  print at most N warnings of each frequent\n"
+                "\t\t\t  kind, one per line, then a summary of the rest\n"
+                "\n"
+                "Optimization options:\n"
+                "  -index-fold=report|rewrite\n"
+                "\t\t\t  report or rewrite pairs of 8-bit (ix+d) loads\n"
+                "\t\t\t  and stores of one 16-bit slot as eZ80\n"
+                "\t\t\t  ld rr,(ix+d) or ld (ix+d),rr; a label or\n"
+                "\t\t\t  directive between the two keeps them apart\n"
+                "  -unreachable=warn|drop\n"
+                "\t\t\t  report or drop instructions between an\n"
+                "\t\t\t  unconditional jump or return and the next label\n"
+                "  -fuse-call-ret\t  assemble call nn; ret as jp nn and\n"
+                "\t\t\t  call cc,nn; ret as jp cc,nn; ret\n"
+                "  -synthetic\t\t  accept ld rr,rr, sub hl,rr, 16-bit shifts\n"
+                "\t\t\t  (sla/sra/srl/rl/rr rr) and mul d,e, expanded\n"
+                "\t\t\t  to the fastest sequence for the CPU\n"
+                "\n"
+                "Banking options:\n"
+                "  -far-port=PORT\t  farcall/farjp trampolines select the bank\n"
+                "\t\t\t  with out (PORT),a (e.g. 0xFE for the MSX\n"
+                "\t\t\t  memory mapper)\n"
+                "  -far-shadow=ADDR\t  byte mirroring the bank register, needed\n"
+                "\t\t\t  on the GBZ80 and with -far-port (default\n"
+                "\t\t\t  0x5B5C, BANKM, for the 128K port 0x7ffd)\n"
                 "\n"
                 "Default: -march=z80+xyhl+infc\n"));
 }
@@ -562,7 +962,6 @@ void
 md_begin (void)
 {
   expressionS nul, reg;
-  char * p;
   char buf[BUFLEN];
 
   memset (&reg, 0, sizeof (reg));
@@ -571,16 +970,20 @@ md_begin (void)
   if (ins_ok & INS_EZ80)
     listing_lhs_width = 6;
 
+  setup_isa_gate ();
+  check_march_usable ();
   initialize_register_expression(&reg);
   register_all_symbols(&reg, buf);
   
-  p = input_line_pointer;
-  input_line_pointer = (char *) "0";
-  nul.X_md = 0;
-  expression (&nul);
-  input_line_pointer = p;
+  nul.X_op = O_constant;
+  nul.X_add_number = 0;
   zero = make_expr_symbol (&nul);
   linkrelax = 0;
+
+  build_cpu_instab ();
+
+  if (encode_cache_file)
+    load_encode_cache ();
 }
 
 static void initialize_register_expression(expressionS *reg)
@@ -606,13 +1009,15 @@ static void register_all_symbols(expressionS *reg, char *buf)
 
 static int should_skip_register(unsigned int index)
 {
-  return regtable[index].isa && !(regtable[index].isa & ins_ok);
+  return regtable[index].isa
+    && !(regtable[index].isa & ins_ok & (gate_silent | gate_warn));
 }
 
 static void register_symbol_variations(expressionS *reg, const char *name, char *buf)
 {
   unsigned int name_length = strlen(name);
   unsigned int variation_count;
+  unsigned int caseless = 0;
   unsigned int j;
   
   if (name_length + 1 >= BUFLEN)
@@ -620,9 +1025,17 @@ static void register_symbol_variations(expressionS *reg, const char *name, char
   
   buf[name_length] = 0;
   variation_count = 1 << name_length;
+
+  /* Characters without case, such as the ' of af', would give the
+     same name twice.  */
+  for (j = 0; j < name_length; ++j)
+    if (TOUPPER(name[j]) == name[j])
+      caseless |= 1 << j;
   
   for (j = variation_count; j > 0; --j)
     {
+      if (j & caseless)
+        continue;
       create_symbol_variation(name, buf, j, name_length);
       register_single_symbol(buf, reg);
     }
@@ -638,11 +1051,13 @@ static void create_symbol_variation(const char *name, char *buf, unsigned int va
     }
 }
 
+/* Nothing can have defined a register name before md_begin, so the
+   symbol is created directly instead of being looked up first.  */
 static void register_single_symbol(const char *name, expressionS *reg)
 {
-  symbolS *psym = symbol_find_or_make(name);
-  S_SET_SEGMENT(psym, reg_section);
+  symbolS *psym = symbol_new(name, reg_section, &zero_address_frag, 0);
   symbol_set_value_expression(psym, reg);
+  symbol_table_insert(psym);
 }
 
 void
@@ -650,6 +1065,465 @@ z80_md_finish (void)
 {
   int mach_type = get_machine_type(ins_ok & INS_MARCH_MASK);
   bfd_set_arch_mach (stdoutput, TARGET_ARCH, mach_type);
+
+  end_unreachable (0);
+
+  emit_far_trampolines ();
+
+  if (image_file && !had_errors ())
+    write_image ();
+
+  if (size_report)
+    print_size_report ();
+
+  if (encode_cache_file)
+    save_encode_cache ();
+
+  report_check_targets ();
+
+  if (auto_suffix)
+    check_label_modes ();
+
+  report_diagnostics ();
+}
+
+/* Direct image output.  Frags of every loadable section are laid out
+   back to back starting at address 0, fixups are resolved against
+   that layout, and the bytes from IMAGE_ORIGIN on are written to
+   IMAGE_FILE.  No BFD relocations are involved, so this only suits
+   single-unit absolute programs.  */
+
+struct image_section
+{
+  segT seg;
+  addressT base;
+  addressT size;
+};
+
+static struct image_section *image_sections;
+static unsigned image_section_count;
+
+/* Return the fixed part of FRAGP, which is still growing if it is
+   the last frag of FRCH.  */
+static addressT
+image_frag_fix (frchainS *frch, fragS *fragP)
+{
+  if (fragP == frch->frch_last)
+    return (char *) obstack_next_free (&frch->frch_obstack) - fragP->fr_literal;
+  return fragP->fr_fix;
+}
+
+/* Return the number of bytes following the fixed part of FRAGP,
+   placed at ADDRESS, the way relax_segment would size it.  */
+static addressT
+image_frag_var (fragS *fragP, addressT address, addressT fix)
+{
+  addressT end = address + fix;
+  addressT target;
+  offsetT amount;
+
+  switch (fragP->fr_type)
+    {
+    case rs_fill:
+      return fragP->fr_var * fragP->fr_offset;
+    case rs_align:
+    case rs_align_code:
+      target = (end + ((addressT) 1 << fragP->fr_offset) - 1)
+	& -((addressT) 1 << fragP->fr_offset);
+      if (fragP->fr_subtype != 0 && target - end > fragP->fr_subtype)
+	return 0;
+      return target - end;
+    case rs_org:
+      target = fragP->fr_offset;
+      if (fragP->fr_symbol)
+	target += S_GET_VALUE (fragP->fr_symbol);
+      if (target < end)
+	{
+	  as_bad_where (fragP->fr_file, fragP->fr_line,
+			_("attempt to move .org backwards"));
+	  return 0;
+	}
+      return target - end;
+    case rs_space:
+      amount = S_GET_VALUE (fragP->fr_symbol);
+      return amount < 0 ? 0 : amount;
+    default:
+      as_bad_where (fragP->fr_file, fragP->fr_line,
+		    _("frag type %d is not supported in images"),
+		    (int) fragP->fr_type);
+      return 0;
+    }
+}
+
+static addressT
+image_layout_section (segT seg)
+{
+  frchainS *frch;
+  fragS *fragP;
+  addressT address = 0;
+
+  for (frch = seg_info (seg)->frchainP; frch; frch = frch->frch_next)
+    for (fragP = frch->frch_root; fragP; fragP = fragP->fr_next)
+      {
+	addressT fix = image_frag_fix (frch, fragP);
+
+	fragP->fr_address = address;
+	address += fix + image_frag_var (fragP, address, fix);
+      }
+  return address;
+}
+
+static void
+image_layout (void)
+{
+  asection *sec;
+  addressT base = 0;
+  unsigned n = 0;
+
+  for (sec = stdoutput->sections; sec; sec = sec->next)
+    if ((bfd_section_flags (sec) & (SEC_ALLOC | SEC_LOAD))
+	== (SEC_ALLOC | SEC_LOAD) && seg_info (sec))
+      ++n;
+
+  image_sections = XNEWVEC (struct image_section, n);
+  image_section_count = 0;
+  for (sec = stdoutput->sections; sec; sec = sec->next)
+    if ((bfd_section_flags (sec) & (SEC_ALLOC | SEC_LOAD))
+	== (SEC_ALLOC | SEC_LOAD) && seg_info (sec))
+      {
+	struct image_section *is = &image_sections[image_section_count++];
+
+	is->seg = sec;
+	is->base = base;
+	is->size = image_layout_section (sec);
+	base += is->size;
+      }
+}
+
+static struct image_section *
+image_find_section (segT seg)
+{
+  unsigned i;
+
+  for (i = 0; i < image_section_count; ++i)
+    if (image_sections[i].seg == seg)
+      return &image_sections[i];
+  return NULL;
+}
+
+/* Set *ADDRP to the image address of SYM.  */
+static bool
+image_symbol_address (symbolS *sym, addressT *addrP)
+{
+  valueT value = resolve_symbol_value (sym);
+  segT seg = S_GET_SEGMENT (sym);
+  struct image_section *is;
+
+  if (seg == absolute_section)
+    {
+      *addrP = value;
+      return true;
+    }
+  is = image_find_section (seg);
+  if (is == NULL)
+    return false;
+  *addrP = is->base + value;
+  return true;
+}
+
+static void
+image_fill_section (char *image, addressT image_size,
+		    const struct image_section *is)
+{
+  frchainS *frch;
+  fragS *fragP;
+  fixS *fixP;
+
+  for (frch = seg_info (is->seg)->frchainP; frch; frch = frch->frch_next)
+    {
+      for (fragP = frch->frch_root; fragP; fragP = fragP->fr_next)
+	{
+	  addressT address = is->base + fragP->fr_address;
+	  addressT fix = image_frag_fix (frch, fragP);
+	  addressT var = image_frag_var (fragP, fragP->fr_address, fix);
+	  addressT i;
+
+	  for (i = 0; i < fix + var; ++i, ++address)
+	    if (address >= image_origin && address - image_origin < image_size)
+	      {
+		char c;
+
+		if (i < fix)
+		  c = fragP->fr_literal[i];
+		else if (fragP->fr_var > 0)
+		  c = fragP->fr_literal[fix + (i - fix) % fragP->fr_var];
+		else
+		  c = 0;
+		image[address - image_origin] = c;
+	      }
+	}
+
+      for (fixP = frch->fix_root; fixP; fixP = fixP->fx_next)
+	{
+	  addressT where = is->base + fixP->fx_frag->fr_address + fixP->fx_where;
+	  addressT addr;
+	  long val = fixP->fx_offset;
+
+	  if (fixP->fx_addsy)
+	    {
+	      if (!image_symbol_address (fixP->fx_addsy, &addr))
+		{
+		  as_bad_where (fixP->fx_file, fixP->fx_line,
+				_("symbol `%s' cannot be resolved in image"),
+				S_GET_NAME (fixP->fx_addsy));
+		  continue;
+		}
+	      val += addr;
+	    }
+	  if (fixP->fx_subsy)
+	    {
+	      if (!image_symbol_address (fixP->fx_subsy, &addr))
+		{
+		  as_bad_where (fixP->fx_file, fixP->fx_line,
+				_("symbol `%s' cannot be resolved in image"),
+				S_GET_NAME (fixP->fx_subsy));
+		  continue;
+		}
+	      val -= addr;
+	    }
+	  if (fixP->fx_pcrel)
+	    val -= where;
+	  if (where < image_origin
+	      || where - image_origin + fixP->fx_size > image_size)
+	    continue;
+	  apply_relocation (fixP, get_reloc_desc (fixP->fx_r_type),
+			    image + (where - image_origin), val);
+	}
+    }
+}
+
+static void
+image_put_ihex_record (FILE *f, unsigned type, unsigned address,
+		       const unsigned char *data, unsigned len)
+{
+  unsigned sum = len + (address >> 8) + (address & 0xFF) + type;
+  unsigned i;
+
+  fprintf (f, ":%02X%04X%02X", len, address & 0xFFFF, type);
+  for (i = 0; i < len; ++i)
+    {
+      fprintf (f, "%02X", data[i]);
+      sum += data[i];
+    }
+  fprintf (f, "%02X\n", -sum & 0xFF);
+}
+
+static void
+image_write_ihex (FILE *f, const unsigned char *image, addressT size)
+{
+  unsigned long upper = 0;
+  addressT i;
+
+  for (i = 0; i < size; i += 16)
+    {
+      addressT address = image_origin + i;
+      unsigned len = size - i < 16 ? size - i : 16;
+
+      if ((address >> 16) != upper)
+	{
+	  unsigned char ela[2];
+
+	  upper = address >> 16;
+	  ela[0] = upper >> 8;
+	  ela[1] = upper;
+	  image_put_ihex_record (f, 4, 0, ela, 2);
+	}
+      image_put_ihex_record (f, 0, address, image + i, len);
+    }
+  image_put_ihex_record (f, 1, 0, NULL, 0);
+}
+
+/* ZX Spectrum tape: a CODE header block followed by the data block.  */
+#define TAP_HEADER_SIZE 21
+#define TAP_DATA_OVERHEAD 4
+static char *
+image_build_tap (const char *image, addressT size, addressT *out_size)
+{
+  const char *name = lbasename (image_file);
+  char *tap = XNEWVEC (char, TAP_HEADER_SIZE + TAP_DATA_OVERHEAD + size);
+  char *p = tap;
+  unsigned char sum;
+  addressT i;
+
+  if (size > 0xFFFF - 2 || image_origin + size > 0x10000)
+    as_bad (_("image does not fit in a tape block"));
+
+  *p++ = 19;
+  *p++ = 0;
+  *p++ = 0x00;			/* Header flag.  */
+  *p++ = 3;			/* CODE.  */
+  for (i = 0; i < 10; ++i)
+    *p++ = *name && *name != '.' ? *name++ : ' ';
+  *p++ = size;
+  *p++ = size >> 8;
+  *p++ = image_origin;
+  *p++ = image_origin >> 8;
+  *p++ = 0x00;
+  *p++ = 0x80;
+  for (sum = 0, i = 2; i < TAP_HEADER_SIZE - 1; ++i)
+    sum ^= tap[i];
+  *p++ = sum;
+
+  *p++ = size + 2;
+  *p++ = (size + 2) >> 8;
+  *p++ = (char) 0xFF;		/* Data flag.  */
+  memcpy (p, image, size);
+  for (sum = 0xFF, i = 0; i < size; ++i)
+    sum ^= p[i];
+  p += size;
+  *p++ = sum;
+
+  *out_size = p - tap;
+  return tap;
+}
+
+/* ZX Spectrum 48K snapshot.  Execution starts at IMAGE_ORIGIN, whose
+   address is left on the stack for the loader's RETN.  */
+#define SNA_HEADER_SIZE 27
+#define SNA_RAM_START 0x4000
+#define SNA_RAM_SIZE 0xC000
+#define SNA_STACK 0xFFFC
+static char *
+image_build_sna (const char *image, addressT size, addressT *out_size)
+{
+  char *sna = XCNEWVEC (char, SNA_HEADER_SIZE + SNA_RAM_SIZE);
+  char *ram = sna + SNA_HEADER_SIZE;
+
+  if (image_origin < SNA_RAM_START || image_origin + size > SNA_STACK)
+    as_bad (_("image must lie within 0x%x..0x%x for a snapshot"),
+	    SNA_RAM_START, SNA_STACK - 1);
+  else
+    memcpy (ram + (image_origin - SNA_RAM_START), image, size);
+
+  sna[0] = 0x3F;		/* I.  */
+  sna[15] = 0x3A;		/* IY, as the ROM expects it.  */
+  sna[16] = 0x5C;
+  sna[23] = SNA_STACK & 0xFF;	/* SP.  */
+  sna[24] = SNA_STACK >> 8;
+  sna[25] = 1;			/* IM 1.  */
+  sna[26] = 7;			/* Border.  */
+  ram[SNA_STACK - SNA_RAM_START] = image_origin;
+  ram[SNA_STACK - SNA_RAM_START + 1] = image_origin >> 8;
+
+  *out_size = SNA_HEADER_SIZE + SNA_RAM_SIZE;
+  return sna;
+}
+
+/* GameBoy ROM: pad to a power of two of at least 32K, then fill in the
+   ROM size code, the header checksum and the global checksum.  */
+#define GB_HEADER_END 0x150
+#define GB_ROM_SIZE_CODE 0x148
+#define GB_HEADER_CHECKSUM 0x14D
+#define GB_GLOBAL_CHECKSUM 0x14E
+static char *
+image_build_gb (const char *image, addressT size, addressT *out_size)
+{
+  addressT rom_size = 0x8000;
+  unsigned code = 0;
+  unsigned char sum;
+  unsigned global;
+  addressT i;
+  char *rom;
+
+  if (!(ins_ok & INS_GBZ80))
+    as_warn (_("GameBoy ROM image requested for a non-GameBoy CPU"));
+  if (image_origin != 0 || size < GB_HEADER_END)
+    as_bad (_("GameBoy ROM image must start at 0 and include the header"));
+
+  while (rom_size < size)
+    {
+      rom_size <<= 1;
+      ++code;
+    }
+  rom = XNEWVEC (char, rom_size);
+  memcpy (rom, image, size);
+  memset (rom + size, 0xFF, rom_size - size);
+
+  if (size >= GB_HEADER_END)
+    {
+      rom[GB_ROM_SIZE_CODE] = code;
+      for (sum = 0, i = 0x134; i < GB_HEADER_CHECKSUM; ++i)
+	sum = sum - rom[i] - 1;
+      rom[GB_HEADER_CHECKSUM] = sum;
+      for (global = 0, i = 0; i < rom_size; ++i)
+	if (i != GB_GLOBAL_CHECKSUM && i != GB_GLOBAL_CHECKSUM + 1)
+	  global += (unsigned char) rom[i];
+      rom[GB_GLOBAL_CHECKSUM] = global >> 8;
+      rom[GB_GLOBAL_CHECKSUM + 1] = global;
+    }
+
+  *out_size = rom_size;
+  return rom;
+}
+
+static void
+write_image (void)
+{
+  const struct image_section *last;
+  char *image, *out = NULL;
+  addressT end, size, out_size;
+  unsigned i;
+  FILE *f;
+
+  image_layout ();
+  last = image_section_count ? &image_sections[image_section_count - 1] : NULL;
+  end = last ? last->base + last->size : 0;
+  size = end > image_origin ? end - image_origin : 0;
+
+  image = XCNEWVEC (char, size ? size : 1);
+  for (i = 0; i < image_section_count; ++i)
+    image_fill_section (image, size, &image_sections[i]);
+
+  switch (image_format)
+    {
+    case IMAGE_SNA:
+      out = image_build_sna (image, size, &out_size);
+      break;
+    case IMAGE_TAP:
+      out = image_build_tap (image, size, &out_size);
+      break;
+    case IMAGE_GB:
+      out = image_build_gb (image, size, &out_size);
+      break;
+    default:
+      break;
+    }
+
+  if (!had_errors ())
+    {
+      f = fopen (image_file, image_format == IMAGE_IHEX ? "w" : FOPEN_WB);
+      if (f == NULL)
+	as_bad (_("cannot open image file `%s': %s"), image_file,
+		xstrerror (errno));
+      else
+	{
+	  if (image_format == IMAGE_IHEX)
+	    image_write_ihex (f, (unsigned char *) image, size);
+	  else if (out)
+	    fwrite (out, 1, out_size, f);
+	  else
+	    fwrite (image, 1, size, f);
+	  if (fclose (f) != 0)
+	    as_bad (_("cannot write image file `%s': %s"), image_file,
+		    xstrerror (errno));
+	}
+    }
+
+  free (out);
+  free (image);
+  free (image_sections);
+  image_sections = NULL;
+  image_section_count = 0;
 }
 
 static int
@@ -699,6 +1573,22 @@ z80_start_line_hook (void)
 {
   char *p;
 
+  ++stat_counts[STAT_START_LINE_HOOK];
+
+  if (has_label (input_line_pointer))
+    {
+      forget_last_insn ();
+      end_unreachable (1);
+    }
+  else if (!is_insn_line (input_line_pointer))
+    {
+      /* A directive may set a symbol to the location (x = ., .equ x,$),
+         so nothing before it is fused or folded with what follows.  */
+      forget_last_insn ();
+      if (unreachable_pending ())
+        keep_unreachable ();
+    }
+
   for (p = input_line_pointer; *p && *p != '\n'; ++p)
     {
       if (*p == '\'')
@@ -822,6 +1712,9 @@ process_label_assignment (void)
       return 1;
     }
 
+  if (auto_suffix && c == ':')
+    record_label_mode (name);
+
   restore_line_pointer(c);
   input_line_pointer = line_start;
   return 0;
@@ -916,6 +1809,24 @@ md_pcrel_from (fixS * fixp)
 
 typedef const char * (asfunc)(char, char, const char*);
 
+/* Operands parsed by parse_operands for emitters of the second
+   interface, which encode without scanning any text themselves.  */
+#define MAX_OPERANDS 3
+
+#define OPK_REG   (1 << 0) /* register, possibly indirect: a, hl, (hl) */
+#define OPK_MEM   (1 << 1) /* in parentheses: (hl), (nn) */
+#define OPK_INDEX (1 << 2) /* indexed: (ix+d), (iy+d) */
+#define OPK_IMM   (1 << 3) /* any other expression: n, nn, (nn) */
+
+struct operand_vec
+{
+  int count;
+  unsigned kind[MAX_OPERANDS];
+  expressionS exp[MAX_OPERANDS];
+};
+
+typedef void (asfunc_v2)(char, char, struct operand_vec *);
+
 typedef struct _table_t
 {
   const char* name;
@@ -923,6 +1834,7 @@ typedef struct _table_t
   unsigned char opcode;
   asfunc * fp;
   unsigned inss; /*0 - all CPU types or list of supported INS_* */
+  asfunc_v2 * fp2; /* used instead of FP when set */
 } table_t;
 
 /* Compares the key for structs that start with a char * to the key.  */
@@ -955,19 +1867,130 @@ static void ill_op(void)
     error(_("illegal operand"));
 }
 
+/* Frequent warnings.  Dirty sources can produce them by the hundred
+   thousand, so each one is first passed through warn_enabled, which
+   counts it and decides whether to print it at all.  With -warn-limit=N
+   repeats of a kind on the same source line are dropped and only the
+   first N of a kind are printed.  The message is formatted only if it
+   is printed; report_diagnostics summarizes the rest.  */
+
+static unsigned long diag_counts[DIAG_MAX];
+static unsigned long diag_suppressed[DIAG_MAX];
+static enum diag_kind diag_last_kind = DIAG_MAX;
+static const char *diag_last_file;
+static unsigned int diag_last_line;
+/* warnings warn_enabled told the caller not to print */
+static unsigned long diag_hidden;
+
+static int
+warn_enabled (enum diag_kind kind)
+{
+  const char *file;
+  unsigned int line;
+
+  if (flag_no_warnings)
+    {
+      ++diag_hidden;
+      return 0;
+    }
+
+  ++diag_counts[kind];
+  file = as_where (&line);
+  if (warn_limit
+      && (diag_counts[kind] - diag_suppressed[kind] > warn_limit
+          || (kind == diag_last_kind && line == diag_last_line
+              && file == diag_last_file)))
+    {
+      ++diag_suppressed[kind];
+      ++diag_hidden;
+      return 0;
+    }
+  diag_last_kind = kind;
+  diag_last_file = file;
+  diag_last_line = line;
+  return 1;
+}
+
+static void
+report_diagnostics (void)
+{
+  unsigned i;
+
+  for (i = 0; i < DIAG_MAX; ++i)
+    if (diag_suppressed[i])
+      as_warn (_("%lu of %lu `%s' warnings not shown"),
+               diag_suppressed[i], diag_counts[i], diag_names[i]);
+}
+
+static enum diag_kind
+ins_class_kind (int ins_type)
+{
+  if (ins_type & INS_UNDOC)
+    return DIAG_UNDOC;
+  if (ins_type & INS_UNPORT)
+    return DIAG_UNPORT;
+  return DIAG_UNSUPPORTED;
+}
+
+/* Derive the ISA gate from INS_OK, INS_ERR and INS_WARN.  A class
+   that is neither accepted nor forbidden is assembled with a
+   warning.  */
+static void
+setup_isa_gate (void)
+{
+  gate_silent = ins_ok & ~ins_warn;
+  gate_warn = (ins_ok & ins_warn) | (~ins_ok & ~ins_err);
+}
+
+static const char *
+ins_class_message (int ins_type)
+{
+  if (ins_type & INS_UNDOC)
+    return _("undocumented instruction");
+  if (ins_type & INS_UNPORT)
+    return _("unportable instruction");
+  return _("instruction not supported by the target CPU");
+}
+
 static void
 wrong_mach (int ins_type)
 {
-  if (ins_type & ins_err)
-    ill_op ();
+  if (ins_type & gate_warn)
+    {
+      if (warn_enabled (ins_class_kind (ins_type)))
+        as_warn ("%s", ins_class_message (ins_type));
+    }
   else
-    as_warn (_("undocumented instruction"));
+    error (ins_class_message (ins_type));
+}
+
+/* The GBZ80 differs from the other CPUs in operand forms that are
+   chosen by testing ins_ok rather than through check_mach, so
+   -check-march would miss them.  */
+static void
+check_march_usable (void)
+{
+  if (check_target_count && (ins_ok & INS_GBZ80))
+    as_fatal (_("-check-march cannot be used with the GBZ80"));
+}
+
+/* Note that the current instruction needs INS_TYPE, for -check-march.  */
+static void
+check_target_class (int ins_type)
+{
+  unsigned i;
+
+  for (i = 0; i < check_target_count; ++i)
+    if (!(ins_type & check_targets[i].ins_ok))
+      check_targets[i].failed = 1;
 }
 
 static void
 check_mach (int ins_type)
 {
-  if ((ins_type & ins_ok) == 0)
+  if (check_target_count)
+    check_target_class (ins_type);
+  if ((ins_type & gate_silent) == 0)
     wrong_mach (ins_type);
 }
 
@@ -1060,6 +2083,7 @@ static bool check_unary_operation(expressionS *ex)
 static bool
 contains_register (symbolS *sym)
 {
+    ++stat_counts[STAT_CONTAINS_REGISTER];
     if (!sym)
         return false;
 
@@ -1130,21 +2154,36 @@ static void validate_expression(expressionS *op)
     }
 }
 
+/* Shift counts used by the SDCC '<' and '>' operators.  They are
+   shared by all operands, so huge generated data tables do not create
+   a fresh constant symbol per item.  */
+static symbolS *shift_count_symbols[3];
+
+static symbolS *get_shift_count_symbol(int make_shift)
+{
+    symbolS **sym = &shift_count_symbols[make_shift / 8];
+
+    if (*sym == NULL)
+    {
+        expressionS data;
+
+        memset(&data, 0, sizeof(data));
+        data.X_op = O_constant;
+        data.X_add_number = make_shift;
+        *sym = make_expr_symbol(&data);
+    }
+    return *sym;
+}
+
 static void apply_shift_operation(expressionS *op, int make_shift)
 {
-    expressionS data;
-    
     if (make_shift < 0)
         return;
     
     op->X_add_symbol = make_expr_symbol(op);
     op->X_add_number = 0;
     op->X_op = O_right_shift;
-    
-    memset(&data, 0, sizeof(data));
-    data.X_op = O_constant;
-    data.X_add_number = make_shift;
-    op->X_op_symbol = make_expr_symbol(&data);
+    op->X_op_symbol = get_shift_count_symbol(make_shift);
 }
 
 static const char *parse_exp_not_indexed(const char *s, expressionS *op)
@@ -1153,6 +2192,7 @@ static const char *parse_exp_not_indexed(const char *s, expressionS *op)
     int indir;
     int make_shift = -1;
     
+    ++stat_counts[STAT_PARSE_EXP];
     memset(op, 0, sizeof(*op));
     p = skip_space(s);
     
@@ -1270,28 +2310,84 @@ parse_exp (const char *s, expressionS *op)
   return res;
 }
 
+/* SDCC writes indexed operands as OFFSET (IX).  OP holds the offset;
+   parse the rest, which must be a bare index register in parentheses,
+   without going through parse_exp again.  */
 static const char *
 handle_sdcc_index_syntax (const char *res, expressionS *op)
 {
   expressionS off = *op;
-  res = parse_exp (res, op);
+  res = parse_exp_not_indexed (res, op);
   
-  if (op->X_op != O_md1 || op->X_add_symbol != zero)
+  if (op->X_op != O_register || !op->X_md
+      || (op->X_add_number != REG_IX && op->X_add_number != REG_IY))
     {
       ill_op ();
     }
   else
     {
+      op->X_op = O_md1;
       op->X_add_symbol = make_expr_symbol (&off);
     }
     
   return res;
 }
 
-/* Condition codes, including some synonyms provided by HiTech zas.  */
-static const struct reg_entry cc_tab[] =
+static unsigned
+get_operand_kind (const expressionS *op)
 {
-  { "age", 6 << 3, INS_ALL },
+  switch (op->X_op)
+    {
+    case O_md1:
+      return OPK_INDEX | OPK_MEM;
+    case O_register:
+      return OPK_REG | (op->X_md ? OPK_MEM : 0);
+    default:
+      return OPK_IMM | (op->X_md ? OPK_MEM : 0);
+    }
+}
+
+/* Parse the comma separated operands at S into OPS.  */
+static const char *
+parse_operands (const char *s, struct operand_vec *ops)
+{
+  const char *p = skip_space (s);
+
+  ops->count = 0;
+  if (*p == 0)
+    return p;
+
+  for (;;)
+    {
+      expressionS *op = &ops->exp[ops->count];
+
+      if (ops->count == MAX_OPERANDS)
+        {
+          error (_("bad instruction syntax"));
+          return p;
+        }
+      p = parse_exp (p, op);
+      ops->kind[ops->count++] = get_operand_kind (op);
+      if (*p != ',')
+        return p;
+      ++p;
+    }
+}
+
+/* Check that the emitter got COUNT operands.  */
+static int
+check_operand_count (const struct operand_vec *ops, int count)
+{
+  if (ops->count == count)
+    return 1;
+  error (_("bad instruction syntax"));
+  return 0;
+}
+
+/* Condition codes, including some synonyms provided by HiTech zas.  */
+static const struct reg_entry cc_tab[] =
+{
+  { "age", 6 << 3, INS_ALL },
   { "alt", 7 << 3, INS_ALL },
   { "c",   3 << 3, INS_ALL },
   { "di",  4 << 3, INS_ALL },
@@ -1398,7 +2494,8 @@ static void emit_constant_value(char *p, int64_t value, int size)
 static void check_overflow(expressionS *val, int size)
 {
     const int bits = size * 8;
-    if (!val->X_extrabit && is_overflow(val->X_add_number, bits))
+    if (!val->X_extrabit && is_overflow(val->X_add_number, bits)
+        && warn_enabled(DIAG_OVERFLOW))
         as_warn(_("%d-bit overflow (%+" PRId64 ")"), bits, (int64_t)val->X_add_number);
 }
 
@@ -1545,6 +2642,7 @@ static void emit_data_val(expressionS *val, int size)
         /* Keep original r_type if not processed */
     }
     
+    ++stat_counts[STAT_DATA_FIXUPS];
     fix_new_exp(frag_now, p - frag_now->fr_literal, size, val, false, r_type);
 }
 
@@ -1630,13 +2728,15 @@ static void emit_register_operand(char prefix, char opcode, int shift, int rnum)
     *q++ = opcode + (rnum << shift);
 }
 
-static void emit_indexed_operand(char prefix, char opcode, int shift, int rnum)
+static void emit_indexed_operand(char prefix, char opcode, int shift,
+                                 const expressionS *arg)
 {
+    int rnum = arg->X_add_number;
     char *q = frag_more(2);
     *q++ = (rnum & R_IX) ? 0xDD : 0xFD;
     *q = prefix ? prefix : (opcode + (6 << shift));
     
-    expressionS offset;
+    expressionS offset = *arg;
     offset.X_op = O_symbol;
     offset.X_add_number = 0;
     emit_byte(&offset, BFD_RELOC_Z80_DISP8);
@@ -1695,7 +2795,7 @@ static void emit_mx(char prefix, char opcode, int shift, expressionS *arg)
         if (ins_ok & INS_GBZ80)
             ill_op();
         else
-            emit_indexed_operand(prefix, opcode, shift, rnum);
+            emit_indexed_operand(prefix, opcode, shift, arg);
         break;
         
     default:
@@ -1882,6 +2982,119 @@ emit_swap (char prefix, char opcode, const char *args)
   return p;
 }
 
+/* Automatic eZ80 mode suffixes.  The ADL mode in effect is recorded
+   for every label as it is defined; call and jp to a label recorded in
+   the other mode get the suffix which switches modes: .IL/.IS for call,
+   .LIL/.SIS for jp.  References to labels not yet defined cannot grow
+   afterwards, as this port does no relaxation, so they are only checked
+   in md_finish.  */
+
+struct label_mode_ref
+{
+  const char *name;
+  const char *file;
+  unsigned int line;
+  int mode;
+  struct label_mode_ref *next;
+};
+
+static htab_t label_modes;
+static struct label_mode_ref *label_mode_refs;
+
+static void
+record_label_mode (const char *name)
+{
+  if (!(ins_ok & INS_EZ80))
+    return;
+  if (label_modes == NULL)
+    label_modes = str_htab_create ();
+  str_hash_insert (label_modes, xstrdup (name),
+                   (void *) (intptr_t) (cpu_mode + 1), 1);
+}
+
+/* Return ADL mode of label NAME, or -1 if it is not known yet.  */
+static int
+get_label_mode (const char *name)
+{
+  void *mode;
+
+  if (label_modes == NULL)
+    return -1;
+  mode = str_hash_find (label_modes, name);
+  return mode ? (int) (intptr_t) mode - 1 : -1;
+}
+
+static int
+is_call_opcode (char opcode)
+{
+  return (opcode & 0xFF) == 0xCD || (opcode & 0xC7) == 0xC4;
+}
+
+static void
+emit_mode_suffix (char opcode, const expressionS *addr)
+{
+  int mode;
+  int value;
+  const char *sfx;
+
+  if (!auto_suffix || !(ins_ok & INS_EZ80) || (inst_mode & INST_MODE_FORCED)
+      || addr->X_op != O_symbol)
+    return;
+
+  mode = get_label_mode (S_GET_NAME (addr->X_add_symbol));
+  if (mode < 0)
+    {
+      struct label_mode_ref *ref = XNEW (struct label_mode_ref);
+
+      ref->name = S_GET_NAME (addr->X_add_symbol);
+      ref->file = as_where (&ref->line);
+      ref->mode = cpu_mode;
+      ref->next = label_mode_refs;
+      label_mode_refs = ref;
+      return;
+    }
+  if (mode == cpu_mode)
+    return;
+
+  if (is_call_opcode (opcode))
+    sfx = cpu_mode ? "is" : "il";
+  else
+    sfx = cpu_mode ? "sis" : "lil";
+  value = get_instruction_value (get_suffix_index (sfx));
+  *frag_more (1) = value;
+  set_instruction_mode (value);
+}
+
+static void
+check_label_mode_jr (const expressionS *addr)
+{
+  int mode;
+
+  if (!auto_suffix || !(ins_ok & INS_EZ80) || addr->X_op != O_symbol)
+    return;
+  mode = get_label_mode (S_GET_NAME (addr->X_add_symbol));
+  if (mode >= 0 && mode != cpu_mode)
+    as_warn (_("jr to `%s' which is assembled in %s mode"),
+             S_GET_NAME (addr->X_add_symbol), mode ? "ADL" : "Z80");
+}
+
+static void
+check_label_modes (void)
+{
+  struct label_mode_ref *ref;
+
+  for (ref = label_mode_refs; ref; ref = ref->next)
+    {
+      int mode = get_label_mode (ref->name);
+
+      if (mode >= 0 && mode != ref->mode)
+        as_warn_where (ref->file, ref->line,
+                       _("forward reference to `%s' which is assembled in "
+                         "%s mode needs an explicit suffix"),
+                       ref->name, mode ? "ADL" : "Z80");
+    }
+}
+
 static const char *
 emit_call (char prefix ATTRIBUTE_UNUSED, char opcode, const char * args)
 {
@@ -1895,6 +3108,7 @@ emit_call (char prefix ATTRIBUTE_UNUSED, char opcode, const char * args)
       return p;
     }
   
+  emit_mode_suffix (opcode, &addr);
   char *q = frag_more (1);
   *q = opcode;
   emit_word (&addr);
@@ -1902,22 +3116,143 @@ emit_call (char prefix ATTRIBUTE_UNUSED, char opcode, const char * args)
   return p;
 }
 
-/* Operand may be rr, r, (hl), (ix+d), (iy+d).  */
+/* Banked calls.  farcall X and farjp X call or jump to a trampoline
+   which maps the bank holding X and jumps to it; the trampoline of
+   farcall also maps the caller's bank again when X returns.  The bank
+   number is bits 16-23 of the address of X, as with the SDCC >
+   operator.  One trampoline is emitted per target and kind, in
+   section FAR_SECTION_NAME.  The bank is selected by
+     GBZ80       ld (0x2000),a        MBC ROM bank register
+     -far-port   out (PORT),a         e.g. the MSX memory mapper
+     Z80N        nextreg 0x56,a       8K page at 0xC000
+     others      ld bc,0x7ffd         128K Spectrum paging; only the
+                 out (c),a            RAM bank bits 0-2 are changed
+   Except on the Z80N, whose register is read back, the current bank
+   is kept in the shadow byte at -far-shadow, which all code paging
+   memory must update.  farcall saves the old bank under the return
+   address, and preserves all registers and flags both ways; on the
+   GBZ80, which lacks ex (sp),hl, HL is lost.  farjp preserves all
+   registers.  In ADL mode the eZ80 addresses all memory directly, so
+   farcall and farjp are plain call and jp.  */
+
+#define FAR_SECTION_NAME ".farcall"
+#define FAR_SHADOW_128K 0x5B5C
+
+enum far_method
+{
+  FAR_GBZ80,
+  FAR_PORT,
+  FAR_Z80N,
+  FAR_128K
+};
+
+struct far_target
+{
+  symbolS *target;
+  symbolS *tramp;
+  int call;
+  struct far_target *next;
+};
+
+static htab_t far_trampolines;
+static struct far_target *far_targets;
+static struct far_target **far_targets_tail = &far_targets;
+
+static enum far_method
+get_far_method (void)
+{
+  if (ins_ok & INS_GBZ80)
+    return FAR_GBZ80;
+  if (far_port >= 0)
+    return FAR_PORT;
+  if (ins_ok & INS_Z80N)
+    return FAR_Z80N;
+  return FAR_128K;
+}
+
+/* Return the trampoline symbol for a farcall (CALL) or farjp to
+   TARGET, creating it on first use.  */
+static symbolS *
+get_far_trampoline (symbolS *target, int call)
+{
+  const char *name = S_GET_NAME (target);
+  char *key = concat (call ? "call:" : "jp:", name, (const char *) NULL);
+  struct far_target *t;
+
+  if (far_trampolines == NULL)
+    far_trampolines = str_htab_create ();
+
+  t = str_hash_find (far_trampolines, key);
+  if (t == NULL)
+    {
+      char *tname = concat (call ? "__farcall_" : "__farjp_", name,
+                            (const char *) NULL);
+
+      t = XNEW (struct far_target);
+      t->target = target;
+      t->tramp = symbol_new (tname, undefined_section, &zero_address_frag, 0);
+      t->call = call;
+      t->next = NULL;
+      *far_targets_tail = t;
+      far_targets_tail = &t->next;
+      str_hash_insert (far_trampolines, key, t, 0);
+    }
+  else
+    free (key);
+  return t->tramp;
+}
+
 static const char *
-emit_incdec (char prefix, char opcode, const char * args)
+emit_far (char prefix ATTRIBUTE_UNUSED, char opcode, const char * args)
 {
-  expressionS operand;
+  expressionS addr;
   const char *p;
 
-  p = parse_exp (args, &operand);
+  p = parse_exp_not_indexed (args, &addr);
+  if (addr.X_md)
+    {
+      ill_op ();
+      return p;
+    }
+
+  if (!(inst_mode & INST_MODE_IL))
+    {
+      enum far_method method = get_far_method ();
+
+      if (addr.X_op != O_symbol || addr.X_add_number != 0)
+        {
+          as_bad (_("far call target must be a symbol"));
+          return p;
+        }
+      if ((method == FAR_GBZ80 || method == FAR_PORT) && far_shadow < 0)
+        {
+          as_bad (_("far calls on this target need -far-shadow"));
+          return p;
+        }
+      addr.X_add_symbol = get_far_trampoline (addr.X_add_symbol,
+                                              opcode == (char) 0xCD);
+    }
+
+  *frag_more (1) = opcode;
+  emit_word (&addr);
+
+  return p;
+}
+
+/* Operand may be rr, r, (hl), (ix+d), (iy+d).  */
+static void
+emit_incdec (char prefix, char opcode, struct operand_vec *ops)
+{
+  expressionS *operand = &ops->exp[0];
+
+  if (!check_operand_count (ops, 1))
+    return;
   
-  if (is_valid_register_operand(&operand)) {
-    emit_register_instruction(prefix, operand.X_add_number);
+  if (is_valid_register_operand(operand)) {
+    emit_register_instruction(prefix, operand->X_add_number);
   } else {
-    emit_alternative_instruction(opcode, &operand);
+    emit_alternative_instruction(opcode, operand);
   }
-  
-  return p;
 }
 
 static int is_valid_register_operand(const expressionS *operand)
@@ -1969,6 +3304,7 @@ emit_jr (char prefix ATTRIBUTE_UNUSED, char opcode, const char * args)
       return p;
     }
   
+  check_label_mode_jr (&addr);
   char *q = frag_more (1);
   *q = opcode;
   addr.X_add_number--;
@@ -2051,27 +3387,27 @@ static void emit_c_register_jump(void)
 
 static void emit_standard_jump(char opcode, expressionS *addr)
 {
+  emit_mode_suffix(opcode, addr);
   char *q = frag_more(1);
   *q = opcode;
   emit_word(addr);
 }
 
-static const char *
-emit_im (char prefix, char opcode, const char * args)
+static void
+emit_im (char prefix, char opcode, struct operand_vec *ops)
 {
-  expressionS mode;
-  const char *p;
+  expressionS *mode = &ops->exp[0];
 
-  p = parse_exp (args, & mode);
+  if (!check_operand_count (ops, 1))
+    return;
   
-  if (!is_valid_mode(&mode))
+  if (!is_valid_mode(mode))
     {
       ill_op ();
-      return p;
+      return;
     }
     
-  process_im_mode(prefix, opcode, &mode);
-  return p;
+  process_im_mode(prefix, opcode, mode);
 }
 
 static int
@@ -2101,20 +3437,21 @@ process_im_mode(char prefix, char opcode, expressionS *mode)
     }
 }
 
-static const char *emit_pop(char prefix ATTRIBUTE_UNUSED, char opcode, const char *args)
+static void emit_pop(char prefix ATTRIBUTE_UNUSED, char opcode, struct operand_vec *ops)
 {
-    expressionS regp;
-    const char *p;
+    if (check_operand_count(ops, 1))
+        emit_pop_operand(opcode, &ops->exp[0]);
+}
 
-    p = parse_exp(args, &regp);
-    
-    if (!is_valid_pop_register(&regp)) {
+/* Encode pop or push of the already parsed register REGP.  */
+static void emit_pop_operand(char opcode, const expressionS *regp)
+{
+    if (!is_valid_pop_register(regp)) {
         ill_op();
-        return p;
+        return;
     }
 
-    emit_pop_instruction(opcode, regp.X_add_number);
-    return p;
+    emit_pop_instruction(opcode, regp->X_add_number);
 }
 
 static int is_valid_pop_register(const expressionS *regp)
@@ -2138,24 +3475,25 @@ static void emit_pop_instruction(char opcode, int rnum)
     *q = opcode + ((rnum & 3) << 4);
 }
 
-static const char *
-emit_push (char prefix, char opcode, const char * args)
+static void
+emit_push (char prefix ATTRIBUTE_UNUSED, char opcode, struct operand_vec *ops)
 {
-  expressionS arg;
-  const char *p;
+  expressionS *arg = &ops->exp[0];
 
-  p = parse_exp (args, & arg);
+  if (!check_operand_count (ops, 1))
+    return;
   
-  if (arg.X_op == O_register)
-    return emit_pop (prefix, opcode, args);
+  if (ops->kind[0] & OPK_REG)
+    {
+      emit_pop_operand (opcode, arg);
+      return;
+    }
 
-  if (arg.X_md || arg.X_op == O_md1 || !(ins_ok & INS_Z80N))
+  if ((ops->kind[0] & OPK_MEM) || !(ins_ok & INS_Z80N))
     ill_op ();
 
   emit_instruction_bytes();
-  emit_fixup(&arg);
-
-  return p;
+  emit_fixup(arg);
 }
 
 static void emit_instruction_bytes(void)
@@ -2444,25 +3782,20 @@ static int is_bit_instruction(char opcode)
 }
 
 /* BSLA DE,B; BSRA DE,B; BSRL DE,B; BSRF DE,B; BRLC DE,B (Z80N only) */
-static const char *
-emit_bshft (char prefix, char opcode, const char * args)
+static void
+emit_bshft (char prefix, char opcode, struct operand_vec *ops)
 {
-  expressionS r1, r2;
-  const char *p;
   char *q;
 
-  p = parse_exp (args, & r1);
-  if (*p++ != ',')
-    error (_("bad instruction syntax"));
-  p = parse_exp (p, & r2);
+  if (!check_operand_count (ops, 2))
+    return;
   
-  if (!is_register_de(&r1) || !is_register_b(&r2))
+  if (!is_register_de(&ops->exp[0]) || !is_register_b(&ops->exp[1]))
     ill_op ();
     
   q = frag_more (2);
   *q++ = prefix;
   *q = opcode;
-  return p;
 }
 
 static int is_register_de(const expressionS *expr)
@@ -3422,7 +4755,8 @@ static int adjust_ez80_opcode(int opcode) {
         case LIS_PREFIX:
         case SIL_PREFIX:
         case LIL_PREFIX:
-            as_warn(_("unsupported instruction, assembled as NOP"));
+            if (warn_enabled(DIAG_NOP))
+                as_warn(_("unsupported instruction, assembled as NOP"));
             return 0x00;
         default:
             return opcode;
@@ -4022,16 +5356,6 @@ static int is_valid_register(const expressionS *expr, int expected_reg)
          expr->X_add_number == expected_reg;
 }
 
-static const char *parse_register_pair(const char *args, expressionS *r1, expressionS *r2)
-{
-  const char *p = parse_exp(args, r1);
-  
-  if (*p++ != ',')
-    error(_("bad instruction syntax"));
-  
-  return parse_exp(p, r2);
-}
-
 static void validate_de_register_pair(const expressionS *r1, const expressionS *r2)
 {
   if (!is_valid_register(r1, REG_D) || !is_valid_register(r2, REG_E))
@@ -4045,16 +5369,14 @@ static void emit_instruction_bytes(char prefix, char opcode)
   *q = opcode;
 }
 
-static const char *
-emit_mul(char prefix, char opcode, const char *args)
+static void
+emit_mul(char prefix, char opcode, struct operand_vec *ops)
 {
-  expressionS r1, r2;
+  if (!check_operand_count(ops, 2))
+    return;
   
-  const char *p = parse_register_pair(args, &r1, &r2);
-  validate_de_register_pair(&r1, &r2);
+  validate_de_register_pair(&ops->exp[0], &ops->exp[1]);
   emit_instruction_bytes(prefix, opcode);
-  
-  return p;
 }
 
 static int is_invalid_expression(const expressionS *expr)
@@ -4237,25 +5559,22 @@ emit_tst (char prefix, char opcode, const char *args)
   return p;
 }
 
-static const char *
-emit_insn_n (char prefix, char opcode, const char *args)
+static void
+emit_insn_n (char prefix, char opcode, struct operand_vec *ops)
 {
-  expressionS arg;
-  const char *p;
   char *q;
 
-  p = parse_exp (args, & arg);
+  if (!check_operand_count (ops, 1))
+    return;
   
-  if (arg.X_md || arg.X_op == O_register || arg.X_op == O_md1)
+  if (ops->kind[0] != OPK_IMM)
     ill_op ();
 
   q = frag_more (2);
   *q++ = prefix;
   *q = opcode;
   
-  emit_byte (& arg, BFD_RELOC_8);
-
-  return p;
+  emit_byte (& ops->exp[0], BFD_RELOC_8);
 }
 
 static int is_quote_char(char c)
@@ -4297,7 +5616,7 @@ static const char* process_expression(const char* p)
         return NULL;
     }
     
-    if (exp.X_md)
+    if (exp.X_md && warn_enabled(DIAG_PARENS))
         as_warn(_("parentheses ignored"));
     
     emit_byte(&exp, BFD_RELOC_8);
@@ -4306,6 +5625,7 @@ static const char* process_expression(const char* p)
 
 static void emit_data(int size ATTRIBUTE_UNUSED)
 {
+    ++stat_counts[STAT_EMIT_DATA];
     if (is_it_end_of_statement())
     {
         demand_empty_rest_of_line();
@@ -4332,482 +5652,2359 @@ static void emit_data(int size ATTRIBUTE_UNUSED)
     input_line_pointer = (char*)(p - 1);
 }
 
-static void
-z80_cons (int size)
-{
-  const char *p;
+/* Compressed data.
+     dbrle LEN, ITEM[, ITEM...]     dblz4 LEN, ITEM[, ITEM...]
+     incrle LEN, "FILE"             inclz4 LEN, "FILE"
+   ITEMs are strings and constant expressions as for db.  The bytes,
+   or the contents of FILE, are emitted compressed, and the absolute
+   symbol LEN is set to the uncompressed length.
+   RLE: a control byte N is followed by N literal bytes if N is 1-127,
+   or by one byte repeated N-126 times if N is 128-255; 0 ends the data.
+   LZ4: a raw LZ4 block, without the frame header.  */
 
-  if (is_it_end_of_statement ())
-    {
-      demand_empty_rest_of_line ();
-      return;
-    }
-  
-  p = skip_space (input_line_pointer);
-  process_expression_list (p, size);
-}
+#define COMPRESS_RLE  0
+#define COMPRESS_LZ4  1
+#define COMPRESS_FILE 2
 
-static void
-process_expression_list (const char *p, int size)
+#define RLE_LITERAL_MAX 127
+#define RLE_RUN_MAX 129
+
+static size_t
+rle_literals (const unsigned char *in, size_t len, unsigned char *out,
+              size_t o)
 {
-  expressionS exp;
-  
-  do
+  while (len)
     {
-      p = parse_exp (p, &exp);
-      
-      if (!validate_expression (&exp))
-        break;
-      
-      emit_expression (&exp, size);
-      p = skip_space (p);
-    } 
-  while (*p++ == ',');
-  
-  input_line_pointer = (char *)(p - 1);
+      size_t n = len < RLE_LITERAL_MAX ? len : RLE_LITERAL_MAX;
+
+      out[o++] = n;
+      memcpy (out + o, in, n);
+      o += n;
+      in += n;
+      len -= n;
+    }
+  return o;
 }
 
-static int
-validate_expression (expressionS *exp)
+static size_t
+compress_rle (const unsigned char *in, size_t len, unsigned char *out)
 {
-  if (exp->X_op == O_md1 || exp->X_op == O_register)
+  size_t i = 0, o = 0, start = 0;
+
+  while (i < len)
     {
-      ill_op ();
-      return 0;
+      size_t run = 1;
+
+      while (i + run < len && run < RLE_RUN_MAX && in[i + run] == in[i])
+        ++run;
+      /* A run of two only pays when it does not split a literal.  */
+      if (run >= 3 || (run == 2 && start == i))
+        {
+          o = rle_literals (in + start, i - start, out, o);
+          out[o++] = run + 126;
+          out[o++] = in[i];
+          start = i + run;
+        }
+      i += run;
     }
-  
-  if (exp->X_md)
-    as_warn (_("parentheses ignored"));
-  
-  return 1;
+  o = rle_literals (in + start, len - start, out, o);
+  out[o++] = 0;
+  return o;
 }
 
-static void
-emit_expression (expressionS *exp, int size)
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 0xFFFF
+#define LZ4_HASH_BITS 12
+/* The last match must start this far from the end, and the last
+   literals must be at least LZ4_LAST_LITERALS long.  */
+#define LZ4_MF_LIMIT 12
+#define LZ4_LAST_LITERALS 5
+
+static size_t
+lz4_length (unsigned char *out, size_t o, size_t n)
 {
-  emit_data_val (exp, size);
+  for (; n >= 0xFF; n -= 0xFF)
+    out[o++] = 0xFF;
+  out[o++] = n;
+  return o;
 }
 
-/* next functions were commented out because it is difficult to mix
-   both ADL and Z80 mode instructions within one COFF file:
-   objdump cannot recognize point of mode switching.
-*/
-static void
-set_cpu_mode (int mode)
+/* Append a sequence of NLIT literals from LIT followed by a match of
+   MLEN bytes OFFSET back; MLEN is zero for the final sequence.  */
+static size_t
+lz4_sequence (const unsigned char *lit, size_t nlit, size_t offset,
+              size_t mlen, unsigned char *out, size_t o)
 {
-  if (ins_ok & INS_EZ80)
-    cpu_mode = mode;
-  else
-    error (_("CPU mode is unsupported by target"));
+  size_t ml = mlen ? mlen - LZ4_MIN_MATCH : 0;
+
+  out[o++] = ((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15);
+  if (nlit >= 15)
+    o = lz4_length (out, o, nlit - 15);
+  memcpy (out + o, lit, nlit);
+  o += nlit;
+  if (mlen)
+    {
+      out[o++] = offset & 0xFF;
+      out[o++] = offset >> 8;
+      if (ml >= 15)
+        o = lz4_length (out, o, ml - 15);
+    }
+  return o;
 }
 
-static void
-assume (int arg ATTRIBUTE_UNUSED)
+static size_t
+compress_lz4 (const unsigned char *in, size_t len, unsigned char *out)
 {
-  char *name;
-  char c;
-  int n;
+  size_t *table = XCNEWVEC (size_t, 1 << LZ4_HASH_BITS);
+  size_t i = 0, o = 0, anchor = 0;
+  size_t limit = len > LZ4_MF_LIMIT ? len - LZ4_MF_LIMIT : 0;
 
-  input_line_pointer = (char*)skip_space (input_line_pointer);
-  c = get_symbol_name (& name);
-  if (strncasecmp (name, "ADL", 4) != 0)
+  while (i < limit)
     {
-      ill_op ();
-      return;
-    }
+      uint32_t seq = in[i] | (in[i + 1] << 8) | (in[i + 2] << 16)
+                     | ((uint32_t) in[i + 3] << 24);
+      unsigned h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+      size_t cand = table[h];
 
-  restore_line_pointer (c);
-  input_line_pointer = (char*)skip_space (input_line_pointer);
-  if (*input_line_pointer++ != '=')
-    {
-      error (_("assignment expected"));
-      return;
+      /* Table entries are positions plus one, zero being empty.  */
+      table[h] = i + 1;
+      if (cand && i - (cand - 1) <= LZ4_MAX_OFFSET
+          && memcmp (in + cand - 1, in + i, LZ4_MIN_MATCH) == 0)
+        {
+          size_t m = cand - 1;
+          size_t mlen = LZ4_MIN_MATCH;
+
+          while (i + mlen < len - LZ4_LAST_LITERALS
+                 && in[m + mlen] == in[i + mlen])
+            ++mlen;
+          o = lz4_sequence (in + anchor, i - anchor, i - m, mlen, out, o);
+          i += mlen;
+          anchor = i;
+        }
+      else
+        ++i;
     }
-  input_line_pointer = (char*)skip_space (input_line_pointer);
-  n = get_single_number ();
-
-  set_cpu_mode (n);
+  o = lz4_sequence (in + anchor, len - anchor, 0, 0, out, o);
+  free (table);
+  return o;
 }
 
+/* Append the bytes of the items at P to *DATA, which holds *LEN bytes
+   in *ALLOC.  Return the end of the items.  */
 static const char *
-emit_mulub (char prefix ATTRIBUTE_UNUSED, char opcode, const char * args)
+compress_items (const char *p, unsigned char **data, size_t *len,
+                size_t *alloc)
 {
-  const char *p = skip_space (args);
-  
-  if (TOLOWER (*p++) != 'a' || *p++ != ',')
+  do
     {
-      ill_op ();
-      return p;
+      size_t need;
+
+      p = skip_space (p);
+      need = *len + (is_quote_char (*p) ? strlen (p) : 1);
+      if (need > *alloc)
+        {
+          *alloc = need * 2;
+          *data = XRESIZEVEC (unsigned char, *data, *alloc);
+        }
+
+      if (is_quote_char (*p))
+        {
+          char quote = *p++;
+
+          while (*p && *p != quote)
+            (*data)[(*len)++] = *p++;
+          if (!*p)
+            as_warn (_("unterminated string"));
+          else
+            ++p;
+        }
+      else
+        {
+          expressionS exp;
+
+          p = parse_exp (p, &exp);
+          if (exp.X_op == O_md1 || exp.X_op == O_register)
+            {
+              ill_op ();
+              return NULL;
+            }
+          if (exp.X_op != O_constant)
+            {
+              as_bad (_("compressed data must be constant"));
+              return NULL;
+            }
+          if (is_overflow (exp.X_add_number, 8))
+            as_warn (_("value %" PRId64 " truncated to 8 bits"),
+                     (int64_t) exp.X_add_number);
+          (*data)[(*len)++] = exp.X_add_number;
+        }
+      p = skip_space (p);
     }
-  
-  char reg = TOLOWER (*p++);
-  
-  if (reg < 'b' || reg > 'e')
+  while (*p++ == ',');
+  return p - 1;
+}
+
+/* Read FILENAME into *DATA, searching the -I directories like
+   .incbin.  Return zero on failure.  */
+static int
+compress_read_file (const char *filename, unsigned char **data, size_t *len)
+{
+  char *path = xstrdup (filename);
+  FILE *f = fopen (path, FOPEN_RB);
+  size_t alloc = 0;
+  size_t n;
+  size_t i;
+
+  for (i = 0; f == NULL && i < include_dir_count; i++)
     {
-      ill_op ();
-      return p;
+      free (path);
+      path = concat (include_dirs[i], "/", filename, (const char *) NULL);
+      f = fopen (path, FOPEN_RB);
     }
-  
-  check_mach (INS_R800);
-  
-  if (*skip_space (p))
+  if (f == NULL)
     {
-      ill_op ();
-      return p;
+      as_bad (_("cannot open `%s': %s"), filename, xstrerror (errno));
+      free (path);
+      return 0;
     }
-  
-  char *q = frag_more (2);
-  *q++ = prefix;
-  *q = opcode + ((reg - 'b') << 3);
-  
-  return p;
+  register_dependency (path);
+  do
+    {
+      if (*len == alloc)
+        {
+          alloc = alloc ? alloc * 2 : 0x4000;
+          *data = XRESIZEVEC (unsigned char, *data, alloc);
+        }
+      n = fread (*data + *len, 1, alloc - *len, f);
+      *len += n;
+    }
+  while (n > 0);
+  if (ferror (f))
+    as_bad (_("cannot read `%s': %s"), path, xstrerror (errno));
+  fclose (f);
+  free (path);
+  return 1;
 }
 
-static const char *
-emit_muluw (char prefix ATTRIBUTE_UNUSED, char opcode, const char * args)
+static void
+s_compress (int arg)
 {
-  const char *p = skip_space (args);
-  
-  if (TOLOWER (*p++) != 'h' || TOLOWER (*p++) != 'l' || *p++ != ',')
+  unsigned char *data = NULL, *out;
+  size_t len = 0, alloc = 0, out_len;
+  symbolS *lensym;
+  char *name;
+  char c;
+
+  err_flag = 0;
+  input_line_pointer = (char *) skip_space (input_line_pointer);
+  c = get_symbol_name (&name);
+  if (*name == 0)
     {
-      ill_op ();
-      return p;
+      restore_line_pointer (c);
+      as_bad (_("expected length symbol"));
+      ignore_rest_of_line ();
+      return;
     }
-  
-  expressionS reg;
-  p = parse_exp (p, &reg);
-  
-  if (reg.X_md || reg.X_op != O_register)
-    return p;
-    
-  if (reg.X_add_number != REG_BC && reg.X_add_number != REG_SP)
+  lensym = symbol_find_or_make (name);
+  restore_line_pointer (c);
+  input_line_pointer = (char *) skip_space (input_line_pointer);
+  if (*input_line_pointer++ != ',')
     {
-      ill_op ();
-      return p;
+      error (_("bad instruction syntax"));
+      ignore_rest_of_line ();
+      return;
     }
-  
-  check_mach (INS_R800);
-  char *q = frag_more (2);
-  *q++ = prefix;
-  *q = opcode + ((reg.X_add_number & 3) << 4);
-  
-  return p;
-}
 
-static int parse_suffix(const char **suffix, char *sbuf) {
-    const char *p = *suffix;
-    int i;
-    
-    if (*p++ != '.')
-        return 0;
-    
-    for (i = 0; (i < 3) && (ISALPHA(*p)); i++)
-        sbuf[i] = TOLOWER(*p++);
-    
-    if (*p && !is_whitespace(*p))
-        return 0;
-    
-    *suffix = p;
-    sbuf[i] = 0;
-    return 1;
-}
+  if (arg & COMPRESS_FILE)
+    {
+      int name_len;
+      char *filename;
 
-static int get_suffix_index(const char *sbuf) {
-    static const char sf[8][4] = {
-        "il", "is", "l", "lil", "lis", "s", "sil", "sis"
-    };
-    
-    const char (*t)[4] = bsearch(sbuf, sf, ARRAY_SIZE(sf), sizeof(sf[0]), 
-                                 (int(*)(const void*, const void*))strcmp);
-    if (t == NULL)
-        return -1;
-    
-    return t - sf;
-}
+      input_line_pointer = (char *) skip_space (input_line_pointer);
+      filename = demand_copy_C_string (&name_len);
+      if (filename == NULL || !compress_read_file (filename, &data, &len))
+        {
+          ignore_rest_of_line ();
+          return;
+        }
+      demand_empty_rest_of_line ();
+    }
+  else
+    {
+      const char *p = compress_items (input_line_pointer, &data, &len,
+                                      &alloc);
 
-static int get_instruction_value(int index) {
-    static const int values_cpu_mode_true[8] = {
-        0x5B, 0x49, 0x5B, 0x5B, 0x49, 0x52, 0x52, 0x40
-    };
-    static const int values_cpu_mode_false[8] = {
-        0x52, 0x40, 0x49, 0x5B, 0x49, 0x40, 0x52, 0x40
-    };
-    
-    return cpu_mode ? values_cpu_mode_true[index] : values_cpu_mode_false[index];
-}
+      if (p == NULL)
+        {
+          free (data);
+          ignore_rest_of_line ();
+          return;
+        }
+      input_line_pointer = (char *) p;
+    }
 
-static void set_instruction_mode(int value) {
-    #define MODE_SIS 0x40
-    #define MODE_LIS 0x49
-    #define MODE_SIL 0x52
-    #define MODE_LIL 0x5B
-    
-    switch (value) {
-    case MODE_SIS:
-        inst_mode = INST_MODE_FORCED | INST_MODE_S | INST_MODE_IS;
-        break;
-    case MODE_LIS:
-        inst_mode = INST_MODE_FORCED | INST_MODE_L | INST_MODE_IS;
-        break;
-    case MODE_SIL:
-        inst_mode = INST_MODE_FORCED | INST_MODE_S | INST_MODE_IL;
-        break;
-    case MODE_LIL:
-        inst_mode = INST_MODE_FORCED | INST_MODE_L | INST_MODE_IL;
-        break;
+  if (S_IS_DEFINED (lensym))
+    as_bad (_("symbol `%s' is already defined"), S_GET_NAME (lensym));
+  else
+    {
+      S_SET_SEGMENT (lensym, absolute_section);
+      S_SET_VALUE (lensym, len);
+      symbol_set_frag (lensym, &zero_address_frag);
     }
-}
 
-static int assemble_suffix(const char **suffix) {
-    char sbuf[4];
-    int index;
-    int value;
-    
-    if (!parse_suffix(suffix, sbuf))
-        return 0;
-    
-    index = get_suffix_index(sbuf);
-    if (index < 0)
-        return 0;
-    
-    value = get_instruction_value(index);
-    *frag_more(1) = value;
-    set_instruction_mode(value);
-    
-    return 1;
-}
+  /* Worst cases: RLE adds a control byte per 127 literals, LZ4 one
+     length byte per 255 literals, both plus a few bytes of framing.  */
+  out = XNEWVEC (unsigned char, len + len / 64 + 16);
+  if ((arg & ~COMPRESS_FILE) == COMPRESS_LZ4)
+    out_len = compress_lz4 (data, len, out);
+  else
+    out_len = compress_rle (data, len, out);
+  memcpy (frag_more (out_len), out, out_len);
 
-static void
-psect (int arg)
-{
-#if defined(OBJ_ELF)
-  obj_elf_section (arg);
-#elif defined(OBJ_COFF)
-  obj_coff_section (arg);
-#else
-#error Unknown object format
-#endif
+  free (out);
+  free (data);
 }
 
 static void
-set_inss (int inss)
+z80_cons (int size)
 {
-  int old_ins;
-
-  if (!sdcc_compat)
-    as_fatal (_("Invalid directive"));
+  const char *p;
 
-  old_ins = ins_ok;
-  ins_ok = (ins_ok & INS_MARCH_MASK) | inss;
-  if (old_ins != ins_ok)
-    cpu_mode = 0;
+  if (is_it_end_of_statement ())
+    {
+      demand_empty_rest_of_line ();
+      return;
+    }
+  
+  p = skip_space (input_line_pointer);
+  process_expression_list (p, size);
 }
 
 static void
-ignore (int arg ATTRIBUTE_UNUSED)
+process_expression_list (const char *p, int size)
 {
-  ignore_rest_of_line ();
+  expressionS exp;
+  
+  do
+    {
+      p = parse_exp (p, &exp);
+      
+      if (!validate_expression (&exp))
+        break;
+      
+      emit_expression (&exp, size);
+      p = skip_space (p);
+    } 
+  while (*p++ == ',');
+  
+  input_line_pointer = (char *)(p - 1);
 }
 
-static void
-area (int arg)
+static int
+validate_expression (expressionS *exp)
 {
-  char *p;
-  if (!sdcc_compat)
-    as_fatal (_("Invalid directive"));
-  
-  p = find_delimiter();
-  
-  if (*p == '(')
-    {
-      process_area_with_parenthesis(p, arg);
-    }
-  else
+  if (exp->X_op == O_md1 || exp->X_op == O_register)
     {
-      psect (arg);
+      ill_op ();
+      return 0;
     }
+  
+  if (exp->X_md && warn_enabled (DIAG_PARENS))
+    as_warn (_("parentheses ignored"));
+  
+  return 1;
 }
 
-static char*
-find_delimiter (void)
+static void
+emit_expression (expressionS *exp, int size)
 {
-  char *p;
-  for (p = input_line_pointer; *p && *p != '(' && *p != '\n'; p++)
-    ;
-  return p;
+  emit_data_val (exp, size);
+}
+
+/* Mixing ADL and Z80 mode instructions within one COFF file is
+   difficult: objdump cannot recognize point of mode switching.  ELF
+   output marks those points with local mapping symbols instead, in the
+   way ARM marks ARM/Thumb code: $adl or $z80 before the first
+   instruction of each section and after every mode change, and $sis,
+   $lis, $sil or $lil on every instruction with a mode suffix.
+*/
+enum mapping_state
+{
+  MAP_UNDEFINED = -1,
+  MAP_Z80,
+  MAP_ADL,
+  MAP_SIS,
+  MAP_LIS,
+  MAP_SIL,
+  MAP_LIL
+};
+
+#if defined (OBJ_ELF) || defined (OBJ_MAYBE_ELF)
+static const char *const mapping_names[] =
+{
+  "$z80", "$adl", "$sis", "$lis", "$sil", "$lil"
+};
+
+struct mapping_section
+{
+  segT seg;
+  enum mapping_state state;
+  struct mapping_section *next;
+};
+
+static struct mapping_section *mapping_sections;
+#endif
+
+/* Mapping state of an instruction just assembled in INST_MODE.  */
+static enum mapping_state
+get_mapping_state (int mode)
+{
+  if (!(mode & INST_MODE_FORCED))
+    return cpu_mode ? MAP_ADL : MAP_Z80;
+  return MAP_SIS + ((mode & INST_MODE_L) ? 1 : 0)
+    + ((mode & INST_MODE_IL) ? 2 : 0);
 }
 
+/* Emit the mapping symbol for STATE at WHERE in FRAG unless the current
+   section is already in that state.  */
 static void
-process_area_with_parenthesis (char *p, int arg)
+mapping_state (enum mapping_state state, fragS *frag, int where)
 {
-  *p = '\n';
-  psect (arg);
-  *p++ = '(';
-  ignore_rest_of_line ();
+#if defined (OBJ_ELF) || defined (OBJ_MAYBE_ELF)
+  struct mapping_section *ms;
+  symbolS *sym;
+
+  if (!(ins_ok & INS_EZ80))
+    return;
+
+  for (ms = mapping_sections; ms; ms = ms->next)
+    if (ms->seg == now_seg)
+      break;
+  if (ms == NULL)
+    {
+      ms = XNEW (struct mapping_section);
+      ms->seg = now_seg;
+      ms->state = MAP_UNDEFINED;
+      ms->next = mapping_sections;
+      mapping_sections = ms;
+    }
+  if (ms->state == state)
+    return;
+
+  ms->state = state;
+  sym = symbol_new (mapping_names[state], now_seg, frag, where);
+  symbol_get_bfdsym (sym)->flags |= BSF_LOCAL;
+#else
+  (void) state;
+  (void) frag;
+  (void) where;
+#endif
 }
 
-/* Port specific pseudo ops.  */
-const pseudo_typeS md_pseudo_table[] =
+/* Trampoline pieces (see emit_far).  */
+
+static void
+far_bytes (const char *bytes, int n)
 {
-  { ".area", area, 0},
-  { ".assume", assume, 0},
-  { ".ez80", set_inss, INS_EZ80},
-  { ".gbz80", set_inss, INS_GBZ80},
-  { ".module", ignore, 0},
-  { ".optsdcc", ignore, 0},
-  { ".r800", set_inss, INS_R800},
-  { ".set", s_set, 0},
-  { ".z180", set_inss, INS_Z180},
-  { ".hd64", set_inss, INS_Z180},
-  { ".z80", set_inss, INS_Z80},
-  { ".z80n", set_inss, INS_Z80N},
-  { "db" , emit_data, 1},
-  { "d24", z80_cons, 3},
-  { "d32", z80_cons, 4},
-  { "def24", z80_cons, 3},
-  { "def32", z80_cons, 4},
-  { "defb", emit_data, 1},
-  { "defm", emit_data, 1},
-  { "defs", s_space, 1}, /* Synonym for ds on some assemblers.  */
-  { "defw", z80_cons, 2},
-  { "ds",   s_space, 1}, /* Fill with bytes rather than words.  */
-  { "dw", z80_cons, 2},
-  { "psect", psect, 0}, /* TODO: Translate attributes.  */
-  { "set", 0, 0}, 		/* Real instruction on z80.  */
-  { "xdef", s_globl, 0},	/* Synonym for .GLOBAL */
-  { "xref", s_ignore, 0},	/* Synonym for .EXTERN */
-  { NULL, 0, 0 }
-} ;
+  memcpy (frag_more (n), bytes, n);
+}
 
-static table_t instab[] =
+/* Emit OPCODE with the address ADDR.  */
+static void
+far_addr (int opcode, int addr)
 {
-  { "adc",  0x88, 0x4A, emit_adc,  INS_ALL },
-  { "add",  0x80, 0x09, emit_add,  INS_ALL },
-  { "and",  0x00, 0xA0, emit_s,    INS_ALL },
-  { "bit",  0xCB, 0x40, emit_bit,  INS_ALL },
-  { "brlc", 0xED, 0x2C, emit_bshft,INS_Z80N },
-  { "bsla", 0xED, 0x28, emit_bshft,INS_Z80N },
-  { "bsra", 0xED, 0x29, emit_bshft,INS_Z80N },
-  { "bsrf", 0xED, 0x2B, emit_bshft,INS_Z80N },
-  { "bsrl", 0xED, 0x2A, emit_bshft,INS_Z80N },
-  { "call", 0xCD, 0xC4, emit_jpcc, INS_ALL },
-  { "ccf",  0x00, 0x3F, emit_insn, INS_ALL },
-  { "cp",   0x00, 0xB8, emit_s,    INS_ALL },
-  { "cpd",  0xED, 0xA9, emit_insn, INS_NOT_GBZ80 },
-  { "cpdr", 0xED, 0xB9, emit_insn, INS_NOT_GBZ80 },
-  { "cpi",  0xED, 0xA1, emit_insn, INS_NOT_GBZ80 },
-  { "cpir", 0xED, 0xB1, emit_insn, INS_NOT_GBZ80 },
-  { "cpl",  0x00, 0x2F, emit_insn, INS_ALL },
-  { "daa",  0x00, 0x27, emit_insn, INS_ALL },
-  { "dec",  0x0B, 0x05, emit_incdec,INS_ALL },
-  { "di",   0x00, 0xF3, emit_insn, INS_ALL },
-  { "djnz", 0x00, 0x10, emit_jr,   INS_NOT_GBZ80 },
-  { "ei",   0x00, 0xFB, emit_insn, INS_ALL },
-  { "ex",   0x00, 0x00, emit_ex,   INS_NOT_GBZ80 },
-  { "exx",  0x00, 0xD9, emit_insn, INS_NOT_GBZ80 },
-  { "halt", 0x00, 0x76, emit_insn, INS_ALL },
-  { "im",   0xED, 0x46, emit_im,   INS_NOT_GBZ80 },
-  { "in",   0x00, 0x00, emit_in,   INS_NOT_GBZ80 },
-  { "in0",  0xED, 0x00, emit_in0,  INS_Z180|INS_EZ80 },
-  { "inc",  0x03, 0x04, emit_incdec,INS_ALL },
-  { "ind",  0xED, 0xAA, emit_insn, INS_NOT_GBZ80 },
-  { "ind2", 0xED, 0x8C, emit_insn, INS_EZ80 },
-  { "ind2r",0xED, 0x9C, emit_insn, INS_EZ80 },
-  { "indm", 0xED, 0x8A, emit_insn, INS_EZ80 },
-  { "indmr",0xED, 0x9A, emit_insn, INS_EZ80 },
-  { "indr", 0xED, 0xBA, emit_insn, INS_NOT_GBZ80 },
-  { "indrx",0xED, 0xCA, emit_insn, INS_EZ80 },
-  { "ini",  0xED, 0xA2, emit_insn, INS_NOT_GBZ80 },
-  { "ini2", 0xED, 0x84, emit_insn, INS_EZ80 },
-  { "ini2r",0xED, 0x94, emit_insn, INS_EZ80 },
-  { "inim", 0xED, 0x82, emit_insn, INS_EZ80 },
-  { "inimr",0xED, 0x92, emit_insn, INS_EZ80 },
-  { "inir", 0xED, 0xB2, emit_insn, INS_NOT_GBZ80 },
-  { "inirx",0xED, 0xC2, emit_insn, INS_EZ80 },
-  { "jp",   0xC3, 0xC2, emit_jpcc, INS_ALL },
-  { "jr",   0x18, 0x20, emit_jrcc, INS_ALL },
-  { "ld",   0x00, 0x00, emit_ld,   INS_ALL },
-  { "ldd",  0xED, 0xA8, emit_lddldi,INS_ALL }, /* GBZ80 has special meaning */
-  { "lddr", 0xED, 0xB8, emit_insn, INS_NOT_GBZ80 },
-  { "lddrx",0xED, 0xBC, emit_insn, INS_Z80N },
-  { "lddx", 0xED, 0xAC, emit_insn, INS_Z80N },
-  { "ldh",  0xE0, 0x00, emit_ldh,  INS_GBZ80 },
-  { "ldhl", 0x00, 0xF8, emit_ldhl, INS_GBZ80 },
-  { "ldi",  0xED, 0xA0, emit_lddldi,INS_ALL }, /* GBZ80 has special meaning */
-  { "ldir", 0xED, 0xB0, emit_insn, INS_NOT_GBZ80 },
-  { "ldirx",0xED, 0xB4, emit_insn, INS_Z80N },
-  { "ldix", 0xED, 0xA4, emit_insn, INS_Z80N },
-  { "ldpirx",0xED,0xB7, emit_insn, INS_Z80N },
-  { "ldws", 0xED, 0xA5, emit_insn, INS_Z80N },
-  { "lea",  0xED, 0x02, emit_lea,  INS_EZ80 },
-  { "mirror",0xED,0x24, emit_insn, INS_Z80N },
-  { "mlt",  0xED, 0x4C, emit_mlt,  INS_Z180|INS_EZ80|INS_Z80N },
-  { "mul",  0xED, 0x30, emit_mul,  INS_Z80N },
-  { "mulub",0xED, 0xC5, emit_mulub,INS_R800 },
-  { "muluw",0xED, 0xC3, emit_muluw,INS_R800 },
-  { "neg",  0xED, 0x44, emit_insn, INS_NOT_GBZ80 },
-  { "nextreg",0xED,0x91,emit_nextreg,INS_Z80N },
-  { "nop",  0x00, 0x00, emit_insn, INS_ALL },
-  { "or",   0x00, 0xB0, emit_s,    INS_ALL },
-  { "otd2r",0xED, 0xBC, emit_insn, INS_EZ80 },
-  { "otdm", 0xED, 0x8B, emit_insn, INS_Z180|INS_EZ80 },
-  { "otdmr",0xED, 0x9B, emit_insn, INS_Z180|INS_EZ80 },
-  { "otdr", 0xED, 0xBB, emit_insn, INS_NOT_GBZ80 },
-  { "otdrx",0xED, 0xCB, emit_insn, INS_EZ80 },
-  { "oti2r",0xED, 0xB4, emit_insn, INS_EZ80 },
-  { "otim", 0xED, 0x83, emit_insn, INS_Z180|INS_EZ80 },
-  { "otimr",0xED, 0x93, emit_insn, INS_Z180|INS_EZ80 },
-  { "otir", 0xED, 0xB3, emit_insn, INS_NOT_GBZ80 },
-  { "otirx",0xED, 0xC3, emit_insn, INS_EZ80 },
-  { "out",  0x00, 0x00, emit_out,  INS_NOT_GBZ80 },
-  { "out0", 0xED, 0x01, emit_out0, INS_Z180|INS_EZ80 },
-  { "outd", 0xED, 0xAB, emit_insn, INS_NOT_GBZ80 },
-  { "outd2",0xED, 0xAC, emit_insn, INS_EZ80 },
-  { "outi", 0xED, 0xA3, emit_insn, INS_NOT_GBZ80 },
-  { "outi2",0xED, 0xA4, emit_insn, INS_EZ80 },
-  { "outinb",0xED,0x90, emit_insn, INS_Z80N },
-  { "pea",  0xED, 0x65, emit_pea,  INS_EZ80 },
-  { "pixelad",0xED,0x94,emit_insn, INS_Z80N },
-  { "pixeldn",0xED,0x93,emit_insn, INS_Z80N },
-  { "pop",  0x00, 0xC1, emit_pop,  INS_ALL },
-  { "push", 0x00, 0xC5, emit_push, INS_ALL },
-  { "res",  0xCB, 0x80, emit_bit,  INS_ALL },
-  { "ret",  0xC9, 0xC0, emit_retcc,INS_ALL },
-  { "reti", 0xED, 0x4D, emit_reti, INS_ALL }, /*GBZ80 has its own opcode for it*/
-  { "retn", 0xED, 0x45, emit_insn, INS_NOT_GBZ80 },
-  { "rl",   0xCB, 0x10, emit_mr,   INS_ALL },
-  { "rla",  0x00, 0x17, emit_insn, INS_ALL },
-  { "rlc",  0xCB, 0x00, emit_mr,   INS_ALL },
-  { "rlca", 0x00, 0x07, emit_insn, INS_ALL },
-  { "rld",  0xED, 0x6F, emit_insn, INS_NOT_GBZ80 },
-  { "rr",   0xCB, 0x18, emit_mr,   INS_ALL },
-  { "rra",  0x00, 0x1F, emit_insn, INS_ALL },
-  { "rrc",  0xCB, 0x08, emit_mr,   INS_ALL },
-  { "rrca", 0x00, 0x0F, emit_insn, INS_ALL },
-  { "rrd",  0xED, 0x67, emit_insn, INS_NOT_GBZ80 },
-  { "rsmix",0xED, 0x7E, emit_insn, INS_EZ80 },
-  { "rst",  0x00, 0xC7, emit_rst,  INS_ALL },
-  { "sbc",  0x98, 0x42, emit_adc,  INS_ALL },
-  { "scf",  0x00, 0x37, emit_insn, INS_ALL },
-  { "set",  0xCB, 0xC0, emit_bit,  INS_ALL },
-  { "setae",0xED, 0x95, emit_insn, INS_Z80N },
-  { "sl1",  0xCB, 0x30, emit_mr,   INS_SLI|INS_Z80N },
-  { "sla",  0xCB, 0x20, emit_mr,   INS_ALL },
-  { "sli",  0xCB, 0x30, emit_mr,   INS_SLI|INS_Z80N },
-  { "sll",  0xCB, 0x30, emit_mr,   INS_SLI|INS_Z80N },
-  { "slp",  0xED, 0x76, emit_insn, INS_Z180|INS_EZ80 },
-  { "sra",  0xCB, 0x28, emit_mr,   INS_ALL },
-  { "srl",  0xCB, 0x38, emit_mr,   INS_ALL },
-  { "stmix",0xED, 0x7D, emit_insn, INS_EZ80 },
-  { "stop", 0x00, 0x10, emit_insn, INS_GBZ80 },
-  { "sub",  0x00, 0x90, emit_sub,  INS_ALL },
-  { "swap", 0xCB, 0x30, emit_swap, INS_GBZ80|INS_Z80N },
-  { "swapnib",0xED,0x23,emit_insn, INS_Z80N },
-  { "test", 0xED, 0x27, emit_insn_n, INS_Z80N },
-  { "tst",  0xED, 0x04, emit_tst,  INS_Z180|INS_EZ80|INS_Z80N },
-  { "tstio",0xED, 0x74, emit_insn_n,INS_Z180|INS_EZ80 },
-  { "xor",  0x00, 0xA8, emit_s,    INS_ALL },
-} ;
+  char *q = frag_more (3);
+
+  q[0] = opcode;
+  q[1] = addr & 0xFF;
+  q[2] = addr >> 8;
+}
+
+/* Emit OPCODE with SIZE bytes of SYM relocated by RELOC.  */
+static void
+far_fix (int opcode, symbolS *sym, int size, bfd_reloc_code_real_type reloc)
+{
+  expressionS exp;
+  char *q = frag_more (1 + size);
+
+  memset (&exp, 0, sizeof (exp));
+  exp.X_op = O_symbol;
+  exp.X_add_symbol = sym;
+  q[0] = opcode;
+  fix_new_exp (frag_now, q + 1 - frag_now->fr_literal, size, &exp, 0, reloc);
+}
+
+/* Map the bank of TARGET, with A, BC and H free.  If SAVE, leave the
+   old bank in H.  */
+static void
+far_select (enum far_method method, symbolS *target, int save)
+{
+  int shadow = far_shadow >= 0 ? far_shadow : FAR_SHADOW_128K;
+
+  switch (method)
+    {
+    case FAR_GBZ80:
+      if (save)
+        {
+          far_addr (0xFA, shadow);               /* ld a,(shadow) */
+          far_bytes ("\x67", 1);                 /* ld h,a */
+        }
+      far_fix (0x3E, target, 1, BFD_RELOC_Z80_BYTE2);
+      far_addr (0xEA, shadow);                   /* ld (shadow),a */
+      far_addr (0xEA, 0x2000);                   /* ld (0x2000),a */
+      break;
+    case FAR_PORT:
+      if (save)
+        {
+          far_addr (0x3A, shadow);
+          far_bytes ("\x67", 1);
+        }
+      far_fix (0x3E, target, 1, BFD_RELOC_Z80_BYTE2);
+      far_addr (0x32, shadow);                   /* ld (shadow),a */
+      far_bytes ("\xD3", 1);                     /* out (port),a */
+      *frag_more (1) = far_port;
+      break;
+    case FAR_Z80N:
+      if (save)
+        /* ld bc,0x243b; ld a,0x56; out (c),a; inc b; in a,(c); ld h,a */
+        far_bytes ("\x01\x3B\x24\x3E\x56\xED\x79\x04\xED\x78\x67", 11);
+      far_fix (0x3E, target, 1, BFD_RELOC_Z80_BYTE2);
+      far_bytes ("\xED\x92\x56", 3);            /* nextreg 0x56,a */
+      break;
+    case FAR_128K:
+      far_addr (0x3A, shadow);
+      if (save)
+        far_bytes ("\x67", 1);
+      far_bytes ("\xE6\xF8\x4F", 3);             /* and 0xf8; ld c,a */
+      far_fix (0x3E, target, 1, BFD_RELOC_Z80_BYTE2);
+      far_bytes ("\xE6\x07\xB1", 3);             /* and 7; or c */
+      far_addr (0x32, shadow);
+      far_bytes ("\x01\xFD\x7F\xED\x79", 5);    /* ld bc,0x7ffd; out (c),a */
+      break;
+    }
+}
+
+/* Map the bank in H again, with A and BC free.  */
+static void
+far_restore (enum far_method method)
+{
+  int shadow = far_shadow >= 0 ? far_shadow : FAR_SHADOW_128K;
+
+  switch (method)
+    {
+    case FAR_GBZ80:
+      far_bytes ("\x7C", 1);                     /* ld a,h */
+      far_addr (0xEA, shadow);
+      far_addr (0xEA, 0x2000);
+      break;
+    case FAR_PORT:
+      far_bytes ("\x7C", 1);
+      far_addr (0x32, shadow);
+      far_bytes ("\xD3", 1);
+      *frag_more (1) = far_port;
+      break;
+    case FAR_Z80N:
+      far_bytes ("\x7C\xED\x92\x56", 4);
+      break;
+    case FAR_128K:
+      /* The callee may have changed the other bits of the port.  */
+      far_bytes ("\x7C\xE6\x07\x67", 4);         /* ld a,h; and 7; ld h,a */
+      far_addr (0x3A, shadow);
+      far_bytes ("\xE6\xF8\xB4", 3);             /* and 0xf8; or h */
+      far_addr (0x32, shadow);
+      far_bytes ("\x01\xFD\x7F\xED\x79", 5);
+      break;
+    }
+}
+
+/* Emit the farcall/farjp trampolines (see emit_far).  */
+static void
+emit_far_trampolines (void)
+{
+  segT seg = now_seg;
+  subsegT subseg = now_subseg;
+  enum far_method method = get_far_method ();
+  struct far_target *t;
+
+  if (far_targets == NULL)
+    return;
+
+  subseg_new (FAR_SECTION_NAME, 0);
+  bfd_set_section_flags (now_seg,
+                         SEC_ALLOC | SEC_LOAD | SEC_READONLY | SEC_CODE);
+  mapping_state (MAP_Z80, frag_now, frag_now_fix ());
+
+  for (t = far_targets; t; t = t->next)
+    {
+      S_SET_SEGMENT (t->tramp, now_seg);
+      symbol_set_frag (t->tramp, frag_now);
+      S_SET_VALUE (t->tramp, frag_now_fix ());
+      symbol_get_bfdsym (t->tramp)->flags |= BSF_LOCAL;
+
+      if (method == FAR_GBZ80)
+        {
+          far_bytes ("\xF5", 1);                 /* push af */
+          far_select (method, t->target, t->call);
+          far_bytes ("\xF1", 1);                 /* pop af */
+          if (t->call)
+            {
+              far_bytes ("\xE5", 1);             /* push hl */
+              far_fix (0xCD, t->target, 2, BFD_RELOC_Z80_WORD0);
+              far_bytes ("\xE1\xF5", 2);         /* pop hl; push af */
+              far_restore (method);
+              far_bytes ("\xF1\xC9", 2);         /* pop af; ret */
+            }
+          else
+            far_fix (0xC3, t->target, 2, BFD_RELOC_Z80_WORD0);
+        }
+      else if (t->call)
+        {
+          far_bytes ("\xE5\xF5\xC5", 3);         /* push hl; push af; push bc */
+          far_select (method, t->target, 1);
+          far_bytes ("\xC1\xF1\xE3", 3);         /* pop bc; pop af; ex (sp),hl */
+          far_fix (0xCD, t->target, 2, BFD_RELOC_Z80_WORD0);
+          far_bytes ("\xE3\xF5\xC5", 3);         /* ex (sp),hl; push af; push bc */
+          far_restore (method);
+          far_bytes ("\xC1\xF1\xE1\xC9", 4);     /* pop bc; pop af; pop hl; ret */
+        }
+      else
+        {
+          far_bytes ("\xF5\xC5", 2);             /* push af; push bc */
+          far_select (method, t->target, 0);
+          far_bytes ("\xC1\xF1", 2);             /* pop bc; pop af */
+          far_fix (0xC3, t->target, 2, BFD_RELOC_Z80_WORD0);
+        }
+    }
+
+  subseg_set (seg, subseg);
+}
+
+/* .jumptable LABEL[,LABEL...]
+
+   Jump to the LABEL selected by the index in A, counting from zero.
+   DE and HL are clobbered.  The stub is followed by the table, in the
+   densest form known when the directive is assembled:
+     ld e,a / ld d,0     ld de,0 / ld e,a in ADL mode
+     ld hl,table
+     add hl,de           once per table entry byte
+     ...                 load the entry, see below
+     jp (hl)
+   A table of byte offsets from the lowest label is used when every
+   label is already defined at a fixed distance before the directive
+   and they all fit in 256 bytes:
+     ld e,(hl) / ld hl,base / add hl,de
+   Otherwise the table holds words, loaded by
+     ld a,(hl) / inc hl / ld h,(hl) / ld l,a
+   or, in ADL mode, 24-bit addresses loaded by ld hl,(hl).  Forward
+   labels always get a word table: the port does no relaxation, so
+   their distance is not known yet.  */
+
+/* Set *DIST to the distance from EXP, a label defined before the
+   current location in the same frag chain, to the current location.
+   Return zero if the distance is not fixed before relaxation.  */
+static int
+backward_distance (const expressionS *exp, offsetT *dist)
+{
+  symbolS *sym = exp->X_add_symbol;
+  fragS *frag;
+  offsetT off;
+
+  if (exp->X_op != O_symbol || !S_IS_DEFINED (sym)
+      || S_GET_SEGMENT (sym) != now_seg || !symbol_constant_p (sym))
+    return 0;
+
+  off = -symbol_get_value_expression (sym)->X_add_number - exp->X_add_number;
+  for (frag = symbol_get_frag (sym); frag != frag_now; frag = frag->fr_next)
+    {
+      if (frag == NULL || frag->fr_type != rs_fill)
+        return 0;
+      off += frag->fr_fix + frag->fr_offset * frag->fr_var;
+    }
+  *dist = off + frag_now_fix ();
+  return *dist >= 0;
+}
+
+static void
+s_jumptable (int arg ATTRIBUTE_UNUSED)
+{
+  expressionS *targets = NULL;
+  offsetT *dists = NULL;
+  offsetT dist_min = 0, dist_max = 0;
+  unsigned count = 0, i;
+  int bytes;
+  expressionS exp;
+  symbolS *table;
+  const char *p;
+  char *q;
+
+  if (is_it_end_of_statement ())
+    {
+      as_bad (_("missing jump table labels"));
+      demand_empty_rest_of_line ();
+      return;
+    }
+
+  err_flag = 0;
+  p = skip_space (input_line_pointer);
+  do
+    {
+      targets = XRESIZEVEC (expressionS, targets, count + 1);
+      p = parse_exp (p, &targets[count]);
+      if (!validate_expression (&targets[count]))
+        break;
+      ++count;
+      p = skip_space (p);
+    }
+  while (*p++ == ',');
+  input_line_pointer = (char *) (p - 1);
+
+  if (count == 0 || err_flag)
+    {
+      free (targets);
+      return;
+    }
+
+  /* Distances are measured from the start of the stub.  */
+  bytes = 1;
+  dists = XNEWVEC (offsetT, count);
+  for (i = 0; i < count && bytes; ++i)
+    {
+      bytes = backward_distance (&targets[i], &dists[i]);
+      if (!bytes)
+        break;
+      if (i == 0 || dists[i] < dist_min)
+        dist_min = dists[i];
+      if (i == 0 || dists[i] > dist_max)
+        dist_max = dists[i];
+    }
+  if (dist_max - dist_min > 0xFF)
+    bytes = 0;
+
+  forget_last_insn ();
+  inst_mode = cpu_mode ? (INST_MODE_L | INST_MODE_IL)
+                       : (INST_MODE_S | INST_MODE_IS);
+  mapping_state (get_mapping_state (inst_mode), frag_now, frag_now_fix ());
+
+  if (cpu_mode)
+    {
+      q = frag_more (5);
+      q[0] = 0x11;
+      q[1] = q[2] = q[3] = 0;
+      q[4] = 0x5F;
+    }
+  else
+    {
+      q = frag_more (3);
+      q[0] = 0x5F;
+      q[1] = 0x16;
+      q[2] = 0;
+    }
+
+  table = symbol_temp_make ();
+  memset (&exp, 0, sizeof (exp));
+  exp.X_op = O_symbol;
+  exp.X_add_symbol = table;
+  *frag_more (1) = 0x21;
+  emit_word (&exp);
+
+  if (bytes)
+    {
+      /* The base is the lowest label, addressed from the first one.  */
+      exp = targets[0];
+      exp.X_add_number += dists[0] - dist_max;
+      q = frag_more (2);
+      q[0] = 0x19;
+      q[1] = 0x5E;
+      *frag_more (1) = 0x21;
+      emit_word (&exp);
+      q = frag_more (2);
+      q[0] = 0x19;
+      q[1] = 0xE9;
+      symbol_set_value_now (table);
+      q = frag_more (count);
+      for (i = 0; i < count; ++i)
+        q[i] = dist_max - dists[i];
+    }
+  else
+    {
+      int size = cpu_mode ? 3 : 2;
+
+      q = frag_more (size);
+      memset (q, 0x19, size);
+      if (cpu_mode)
+        {
+          q = frag_more (3);
+          q[0] = 0xED;
+          q[1] = 0x27;
+          q[2] = 0xE9;
+        }
+      else
+        {
+          q = frag_more (5);
+          q[0] = 0x7E;
+          q[1] = 0x23;
+          q[2] = 0x66;
+          q[3] = 0x6F;
+          q[4] = 0xE9;
+        }
+      symbol_set_value_now (table);
+      for (i = 0; i < count; ++i)
+        emit_data_val (&targets[i], size);
+    }
+
+  free (dists);
+  free (targets);
+}
+
+static void
+set_cpu_mode (int mode)
+{
+  if (ins_ok & INS_EZ80)
+    cpu_mode = mode;
+  else
+    error (_("CPU mode is unsupported by target"));
+}
+
+static void
+assume (int arg ATTRIBUTE_UNUSED)
+{
+  char *name;
+  char c;
+  int n;
+
+  input_line_pointer = (char*)skip_space (input_line_pointer);
+  c = get_symbol_name (& name);
+  if (strncasecmp (name, "ADL", 4) != 0)
+    {
+      ill_op ();
+      return;
+    }
+
+  restore_line_pointer (c);
+  input_line_pointer = (char*)skip_space (input_line_pointer);
+  if (*input_line_pointer++ != '=')
+    {
+      error (_("assignment expected"));
+      return;
+    }
+  input_line_pointer = (char*)skip_space (input_line_pointer);
+  n = get_single_number ();
+
+  set_cpu_mode (n);
+}
+
+static const char *
+emit_mulub (char prefix ATTRIBUTE_UNUSED, char opcode, const char * args)
+{
+  const char *p = skip_space (args);
+  
+  if (TOLOWER (*p++) != 'a' || *p++ != ',')
+    {
+      ill_op ();
+      return p;
+    }
+  
+  char reg = TOLOWER (*p++);
+  
+  if (reg < 'b' || reg > 'e')
+    {
+      ill_op ();
+      return p;
+    }
+  
+  check_mach (INS_R800);
+  
+  if (*skip_space (p))
+    {
+      ill_op ();
+      return p;
+    }
+  
+  char *q = frag_more (2);
+  *q++ = prefix;
+  *q = opcode + ((reg - 'b') << 3);
+  
+  return p;
+}
+
+static const char *
+emit_muluw (char prefix ATTRIBUTE_UNUSED, char opcode, const char * args)
+{
+  const char *p = skip_space (args);
+  
+  if (TOLOWER (*p++) != 'h' || TOLOWER (*p++) != 'l' || *p++ != ',')
+    {
+      ill_op ();
+      return p;
+    }
+  
+  expressionS reg;
+  p = parse_exp (p, &reg);
+  
+  if (reg.X_md || reg.X_op != O_register)
+    return p;
+    
+  if (reg.X_add_number != REG_BC && reg.X_add_number != REG_SP)
+    {
+      ill_op ();
+      return p;
+    }
+  
+  check_mach (INS_R800);
+  char *q = frag_more (2);
+  *q++ = prefix;
+  *q = opcode + ((reg.X_add_number & 3) << 4);
+  
+  return p;
+}
+
+static int parse_suffix(const char **suffix, char *sbuf) {
+    const char *p = *suffix;
+    int i;
+    
+    if (*p++ != '.')
+        return 0;
+    
+    for (i = 0; (i < 3) && (ISALPHA(*p)); i++)
+        sbuf[i] = TOLOWER(*p++);
+    
+    if (*p && !is_whitespace(*p))
+        return 0;
+    
+    *suffix = p;
+    sbuf[i] = 0;
+    return 1;
+}
+
+static int get_suffix_index(const char *sbuf) {
+    static const char sf[8][4] = {
+        "il", "is", "l", "lil", "lis", "s", "sil", "sis"
+    };
+    
+    const char (*t)[4] = bsearch(sbuf, sf, ARRAY_SIZE(sf), sizeof(sf[0]), 
+                                 (int(*)(const void*, const void*))strcmp);
+    if (t == NULL)
+        return -1;
+    
+    return t - sf;
+}
+
+static int get_instruction_value(int index) {
+    static const int values_cpu_mode_true[8] = {
+        0x5B, 0x49, 0x5B, 0x5B, 0x49, 0x52, 0x52, 0x40
+    };
+    static const int values_cpu_mode_false[8] = {
+        0x52, 0x40, 0x49, 0x5B, 0x49, 0x40, 0x52, 0x40
+    };
+    
+    return cpu_mode ? values_cpu_mode_true[index] : values_cpu_mode_false[index];
+}
+
+static void set_instruction_mode(int value) {
+    #define MODE_SIS 0x40
+    #define MODE_LIS 0x49
+    #define MODE_SIL 0x52
+    #define MODE_LIL 0x5B
+    
+    switch (value) {
+    case MODE_SIS:
+        inst_mode = INST_MODE_FORCED | INST_MODE_S | INST_MODE_IS;
+        break;
+    case MODE_LIS:
+        inst_mode = INST_MODE_FORCED | INST_MODE_L | INST_MODE_IS;
+        break;
+    case MODE_SIL:
+        inst_mode = INST_MODE_FORCED | INST_MODE_S | INST_MODE_IL;
+        break;
+    case MODE_LIL:
+        inst_mode = INST_MODE_FORCED | INST_MODE_L | INST_MODE_IL;
+        break;
+    }
+}
+
+static int assemble_suffix(const char **suffix) {
+    char sbuf[4];
+    int index;
+    int value;
+    
+    if (!parse_suffix(suffix, sbuf))
+        return 0;
+    
+    index = get_suffix_index(sbuf);
+    if (index < 0)
+        return 0;
+    
+    value = get_instruction_value(index);
+    *frag_more(1) = value;
+    set_instruction_mode(value);
+    
+    return 1;
+}
+
+static void
+psect (int arg)
+{
+#if defined(OBJ_ELF)
+  obj_elf_section (arg);
+#elif defined(OBJ_COFF)
+  obj_coff_section (arg);
+#else
+#error Unknown object format
+#endif
+}
+
+static void
+set_inss (int inss)
+{
+  int old_ins;
+
+  if (!sdcc_compat)
+    as_fatal (_("Invalid directive"));
+
+  old_ins = ins_ok;
+  ins_ok = (ins_ok & INS_MARCH_MASK) | inss;
+  if (old_ins != ins_ok)
+    {
+      cpu_mode = 0;
+      setup_isa_gate ();
+      check_march_usable ();
+      build_cpu_instab ();
+    }
+}
+
+static void
+ignore (int arg ATTRIBUTE_UNUSED)
+{
+  ignore_rest_of_line ();
+}
+
+static void
+area (int arg)
+{
+  char *p;
+  if (!sdcc_compat)
+    as_fatal (_("Invalid directive"));
+  
+  p = find_delimiter();
+  
+  if (*p == '(')
+    {
+      process_area_with_parenthesis(p, arg);
+    }
+  else
+    {
+      psect (arg);
+    }
+}
+
+static char*
+find_delimiter (void)
+{
+  char *p;
+  for (p = input_line_pointer; *p && *p != '(' && *p != '\n'; p++)
+    ;
+  return p;
+}
+
+static void
+process_area_with_parenthesis (char *p, int arg)
+{
+  *p = '\n';
+  psect (arg);
+  *p++ = '(';
+  ignore_rest_of_line ();
+}
+
+/* Port specific pseudo ops.  */
+const pseudo_typeS md_pseudo_table[] =
+{
+  { ".area", area, 0},
+  { ".assume", assume, 0},
+  { ".ez80", set_inss, INS_EZ80},
+  { ".gbz80", set_inss, INS_GBZ80},
+  { ".module", ignore, 0},
+  { ".optsdcc", ignore, 0},
+  { ".r800", set_inss, INS_R800},
+  { ".set", s_set, 0},
+  { ".z180", set_inss, INS_Z180},
+  { ".hd64", set_inss, INS_Z180},
+  { ".z80", set_inss, INS_Z80},
+  { ".z80n", set_inss, INS_Z80N},
+  { "db" , emit_data, 1},
+  { "dblz4", s_compress, COMPRESS_LZ4},
+  { "dbrle", s_compress, COMPRESS_RLE},
+  { "d24", z80_cons, 3},
+  { "d32", z80_cons, 4},
+  { "def24", z80_cons, 3},
+  { "def32", z80_cons, 4},
+  { "defb", emit_data, 1},
+  { "defm", emit_data, 1},
+  { "defs", s_space, 1}, /* Synonym for ds on some assemblers.  */
+  { "defw", z80_cons, 2},
+  { "ds",   s_space, 1}, /* Fill with bytes rather than words.  */
+  { "dw", z80_cons, 2},
+  { "inclz4", s_compress, COMPRESS_LZ4 | COMPRESS_FILE},
+  { "incrle", s_compress, COMPRESS_RLE | COMPRESS_FILE},
+  { "jumptable", s_jumptable, 0},
+  { "psect", psect, 0}, /* TODO: Translate attributes.  */
+  { "set", 0, 0}, 		/* Real instruction on z80.  */
+  { "xdef", s_globl, 0},	/* Synonym for .GLOBAL */
+  { "xref", s_ignore, 0},	/* Synonym for .EXTERN */
+  { NULL, 0, 0 }
+} ;
+
+static table_t instab[] =
+{
+  { "adc",  0x88, 0x4A, emit_adc,  INS_ALL },
+  { "add",  0x80, 0x09, emit_add,  INS_ALL },
+  { "and",  0x00, 0xA0, emit_s,    INS_ALL },
+  { "bit",  0xCB, 0x40, emit_bit,  INS_ALL },
+  { "brlc", 0xED, 0x2C, NULL, INS_Z80N, emit_bshft },
+  { "bsla", 0xED, 0x28, NULL, INS_Z80N, emit_bshft },
+  { "bsra", 0xED, 0x29, NULL, INS_Z80N, emit_bshft },
+  { "bsrf", 0xED, 0x2B, NULL, INS_Z80N, emit_bshft },
+  { "bsrl", 0xED, 0x2A, NULL, INS_Z80N, emit_bshft },
+  { "call", 0xCD, 0xC4, emit_jpcc, INS_ALL },
+  { "ccf",  0x00, 0x3F, emit_insn, INS_ALL },
+  { "cp",   0x00, 0xB8, emit_s,    INS_ALL },
+  { "cpd",  0xED, 0xA9, emit_insn, INS_NOT_GBZ80 },
+  { "cpdr", 0xED, 0xB9, emit_insn, INS_NOT_GBZ80 },
+  { "cpi",  0xED, 0xA1, emit_insn, INS_NOT_GBZ80 },
+  { "cpir", 0xED, 0xB1, emit_insn, INS_NOT_GBZ80 },
+  { "cpl",  0x00, 0x2F, emit_insn, INS_ALL },
+  { "daa",  0x00, 0x27, emit_insn, INS_ALL },
+  { "dec",  0x0B, 0x05, NULL, INS_ALL, emit_incdec },
+  { "di",   0x00, 0xF3, emit_insn, INS_ALL },
+  { "djnz", 0x00, 0x10, emit_jr,   INS_NOT_GBZ80 },
+  { "ei",   0x00, 0xFB, emit_insn, INS_ALL },
+  { "ex",   0x00, 0x00, emit_ex,   INS_NOT_GBZ80 },
+  { "exx",  0x00, 0xD9, emit_insn, INS_NOT_GBZ80 },
+  { "farcall", 0x00, 0xCD, emit_far, INS_ALL },
+  { "farjp", 0x00, 0xC3, emit_far, INS_ALL },
+  { "halt", 0x00, 0x76, emit_insn, INS_ALL },
+  { "im",   0xED, 0x46, NULL, INS_NOT_GBZ80, emit_im },
+  { "in",   0x00, 0x00, emit_in,   INS_NOT_GBZ80 },
+  { "in0",  0xED, 0x00, emit_in0,  INS_Z180|INS_EZ80 },
+  { "inc",  0x03, 0x04, NULL, INS_ALL, emit_incdec },
+  { "ind",  0xED, 0xAA, emit_insn, INS_NOT_GBZ80 },
+  { "ind2", 0xED, 0x8C, emit_insn, INS_EZ80 },
+  { "ind2r",0xED, 0x9C, emit_insn, INS_EZ80 },
+  { "indm", 0xED, 0x8A, emit_insn, INS_EZ80 },
+  { "indmr",0xED, 0x9A, emit_insn, INS_EZ80 },
+  { "indr", 0xED, 0xBA, emit_insn, INS_NOT_GBZ80 },
+  { "indrx",0xED, 0xCA, emit_insn, INS_EZ80 },
+  { "ini",  0xED, 0xA2, emit_insn, INS_NOT_GBZ80 },
+  { "ini2", 0xED, 0x84, emit_insn, INS_EZ80 },
+  { "ini2r",0xED, 0x94, emit_insn, INS_EZ80 },
+  { "inim", 0xED, 0x82, emit_insn, INS_EZ80 },
+  { "inimr",0xED, 0x92, emit_insn, INS_EZ80 },
+  { "inir", 0xED, 0xB2, emit_insn, INS_NOT_GBZ80 },
+  { "inirx",0xED, 0xC2, emit_insn, INS_EZ80 },
+  { "jp",   0xC3, 0xC2, emit_jpcc, INS_ALL },
+  { "jr",   0x18, 0x20, emit_jrcc, INS_ALL },
+  { "ld",   0x00, 0x00, emit_ld,   INS_ALL },
+  { "ldd",  0xED, 0xA8, emit_lddldi,INS_ALL }, /* GBZ80 has special meaning */
+  { "lddr", 0xED, 0xB8, emit_insn, INS_NOT_GBZ80 },
+  { "lddrx",0xED, 0xBC, emit_insn, INS_Z80N },
+  { "lddx", 0xED, 0xAC, emit_insn, INS_Z80N },
+  { "ldh",  0xE0, 0x00, emit_ldh,  INS_GBZ80 },
+  { "ldhl", 0x00, 0xF8, emit_ldhl, INS_GBZ80 },
+  { "ldi",  0xED, 0xA0, emit_lddldi,INS_ALL }, /* GBZ80 has special meaning */
+  { "ldir", 0xED, 0xB0, emit_insn, INS_NOT_GBZ80 },
+  { "ldirx",0xED, 0xB4, emit_insn, INS_Z80N },
+  { "ldix", 0xED, 0xA4, emit_insn, INS_Z80N },
+  { "ldpirx",0xED,0xB7, emit_insn, INS_Z80N },
+  { "ldws", 0xED, 0xA5, emit_insn, INS_Z80N },
+  { "lea",  0xED, 0x02, emit_lea,  INS_EZ80 },
+  { "mirror",0xED,0x24, emit_insn, INS_Z80N },
+  { "mlt",  0xED, 0x4C, emit_mlt,  INS_Z180|INS_EZ80|INS_Z80N },
+  { "mul",  0xED, 0x30, NULL, INS_Z80N, emit_mul },
+  { "mulub",0xED, 0xC5, emit_mulub,INS_R800 },
+  { "muluw",0xED, 0xC3, emit_muluw,INS_R800 },
+  { "neg",  0xED, 0x44, emit_insn, INS_NOT_GBZ80 },
+  { "nextreg",0xED,0x91,emit_nextreg,INS_Z80N },
+  { "nop",  0x00, 0x00, emit_insn, INS_ALL },
+  { "or",   0x00, 0xB0, emit_s,    INS_ALL },
+  { "otd2r",0xED, 0xBC, emit_insn, INS_EZ80 },
+  { "otdm", 0xED, 0x8B, emit_insn, INS_Z180|INS_EZ80 },
+  { "otdmr",0xED, 0x9B, emit_insn, INS_Z180|INS_EZ80 },
+  { "otdr", 0xED, 0xBB, emit_insn, INS_NOT_GBZ80 },
+  { "otdrx",0xED, 0xCB, emit_insn, INS_EZ80 },
+  { "oti2r",0xED, 0xB4, emit_insn, INS_EZ80 },
+  { "otim", 0xED, 0x83, emit_insn, INS_Z180|INS_EZ80 },
+  { "otimr",0xED, 0x93, emit_insn, INS_Z180|INS_EZ80 },
+  { "otir", 0xED, 0xB3, emit_insn, INS_NOT_GBZ80 },
+  { "otirx",0xED, 0xC3, emit_insn, INS_EZ80 },
+  { "out",  0x00, 0x00, emit_out,  INS_NOT_GBZ80 },
+  { "out0", 0xED, 0x01, emit_out0, INS_Z180|INS_EZ80 },
+  { "outd", 0xED, 0xAB, emit_insn, INS_NOT_GBZ80 },
+  { "outd2",0xED, 0xAC, emit_insn, INS_EZ80 },
+  { "outi", 0xED, 0xA3, emit_insn, INS_NOT_GBZ80 },
+  { "outi2",0xED, 0xA4, emit_insn, INS_EZ80 },
+  { "outinb",0xED,0x90, emit_insn, INS_Z80N },
+  { "pea",  0xED, 0x65, emit_pea,  INS_EZ80 },
+  { "pixelad",0xED,0x94,emit_insn, INS_Z80N },
+  { "pixeldn",0xED,0x93,emit_insn, INS_Z80N },
+  { "pop",  0x00, 0xC1, NULL, INS_ALL, emit_pop },
+  { "push", 0x00, 0xC5, NULL, INS_ALL, emit_push },
+  { "res",  0xCB, 0x80, emit_bit,  INS_ALL },
+  { "ret",  0xC9, 0xC0, emit_retcc,INS_ALL },
+  { "reti", 0xED, 0x4D, emit_reti, INS_ALL }, /*GBZ80 has its own opcode for it*/
+  { "retn", 0xED, 0x45, emit_insn, INS_NOT_GBZ80 },
+  { "rl",   0xCB, 0x10, emit_mr,   INS_ALL },
+  { "rla",  0x00, 0x17, emit_insn, INS_ALL },
+  { "rlc",  0xCB, 0x00, emit_mr,   INS_ALL },
+  { "rlca", 0x00, 0x07, emit_insn, INS_ALL },
+  { "rld",  0xED, 0x6F, emit_insn, INS_NOT_GBZ80 },
+  { "rr",   0xCB, 0x18, emit_mr,   INS_ALL },
+  { "rra",  0x00, 0x1F, emit_insn, INS_ALL },
+  { "rrc",  0xCB, 0x08, emit_mr,   INS_ALL },
+  { "rrca", 0x00, 0x0F, emit_insn, INS_ALL },
+  { "rrd",  0xED, 0x67, emit_insn, INS_NOT_GBZ80 },
+  { "rsmix",0xED, 0x7E, emit_insn, INS_EZ80 },
+  { "rst",  0x00, 0xC7, emit_rst,  INS_ALL },
+  { "sbc",  0x98, 0x42, emit_adc,  INS_ALL },
+  { "scf",  0x00, 0x37, emit_insn, INS_ALL },
+  { "set",  0xCB, 0xC0, emit_bit,  INS_ALL },
+  { "setae",0xED, 0x95, emit_insn, INS_Z80N },
+  { "sl1",  0xCB, 0x30, emit_mr,   INS_SLI|INS_Z80N },
+  { "sla",  0xCB, 0x20, emit_mr,   INS_ALL },
+  { "sli",  0xCB, 0x30, emit_mr,   INS_SLI|INS_Z80N },
+  { "sll",  0xCB, 0x30, emit_mr,   INS_SLI|INS_Z80N },
+  { "slp",  0xED, 0x76, emit_insn, INS_Z180|INS_EZ80 },
+  { "sra",  0xCB, 0x28, emit_mr,   INS_ALL },
+  { "srl",  0xCB, 0x38, emit_mr,   INS_ALL },
+  { "stmix",0xED, 0x7D, emit_insn, INS_EZ80 },
+  { "stop", 0x00, 0x10, emit_insn, INS_GBZ80 },
+  { "sub",  0x00, 0x90, emit_sub,  INS_ALL },
+  { "swap", 0xCB, 0x30, emit_swap, INS_GBZ80|INS_Z80N },
+  { "swapnib",0xED,0x23,emit_insn, INS_Z80N },
+  { "test", 0xED, 0x27, NULL, INS_Z80N, emit_insn_n },
+  { "tst",  0xED, 0x04, emit_tst,  INS_Z180|INS_EZ80|INS_Z80N },
+  { "tstio",0xED, 0x74, NULL, INS_Z180|INS_EZ80, emit_insn_n },
+  { "xor",  0x00, 0xA8, emit_s,    INS_ALL },
+} ;
+
+/* Dispatch table specialized for the selected CPU.  */
+static table_t cpu_instab[ARRAY_SIZE (instab)];
+static size_t cpu_instab_index[ARRAY_SIZE (instab)];
+static char cpu_instab_warn[ARRAY_SIZE (instab)];
+static size_t cpu_instab_size;
+
+/* Dispatch counts, parallel to instab.  */
+static unsigned long instab_counts[ARRAY_SIZE (instab)];
+
+/* Size attribution for -z80-size-report.  */
+enum prefix_class
+{
+  PREFIX_NONE,
+  PREFIX_CB,
+  PREFIX_ED,
+  PREFIX_DDFD,
+  PREFIX_DDFD_CB,
+  PREFIX_MAX
+};
+static const char *const prefix_class_names[PREFIX_MAX] =
+  { "none", "CB", "ED", "DD/FD", "DDCB/FDCB" };
+/* Suffix bytes SIS, LIS, SIL, LIL, and no suffix.  */
+static const char *const suffix_names[] =
+  { "sis", "lis", "sil", "lil", "none" };
+
+struct size_by_file
+{
+  const char *file;
+  unsigned long bytes;
+  struct size_by_file *next;
+};
+
+static unsigned long instab_bytes[ARRAY_SIZE (instab)];
+static unsigned long prefix_bytes[PREFIX_MAX];
+static unsigned long suffix_bytes[ARRAY_SIZE (suffix_names)];
+static struct size_by_file *file_bytes;
+
+/* Return the number of bytes emitted since offset WHERE of frag START,
+   and store up to two of them, starting at SKIP, in B.  */
+static int
+bytes_emitted_since (fragS *start, int where, int skip, unsigned char b[2])
+{
+  fragS *f;
+  int n = 0;
+
+  b[0] = b[1] = 0;
+  for (f = start; f; f = f->fr_next)
+    {
+      int end = f == frag_now ? (int) frag_now_fix () : (int) f->fr_fix;
+      int i;
+
+      for (i = f == start ? where : 0; i < end; ++i, ++n)
+        if (n >= skip && n - skip < 2)
+          b[n - skip] = f->fr_literal[i];
+      if (f == frag_now)
+        break;
+    }
+  return n;
+}
+
+static void
+record_insn_size (size_t insn, fragS *start, int where)
+{
+  struct size_by_file *sf;
+  unsigned char b[2];
+  const char *file;
+  unsigned int line;
+  unsigned suffix;
+  int forced = (inst_mode & INST_MODE_FORCED) != 0;
+  int size = bytes_emitted_since (start, where, forced, b);
+  enum prefix_class pc;
+
+  instab_bytes[insn] += size;
+
+  if (b[0] == 0xCB)
+    pc = PREFIX_CB;
+  else if (b[0] == 0xED)
+    pc = PREFIX_ED;
+  else if (b[0] == 0xDD || b[0] == 0xFD)
+    pc = b[1] == 0xCB ? PREFIX_DDFD_CB : PREFIX_DDFD;
+  else
+    pc = PREFIX_NONE;
+  prefix_bytes[pc] += size;
+
+  if (!forced)
+    suffix = ARRAY_SIZE (suffix_names) - 1;
+  else
+    suffix = ((inst_mode & INST_MODE_L) ? 1 : 0)
+             + ((inst_mode & INST_MODE_IL) ? 2 : 0);
+  suffix_bytes[suffix] += size;
+
+  file = as_where (&line);
+  for (sf = file_bytes; sf; sf = sf->next)
+    if (sf->file == file || strcmp (sf->file, file) == 0)
+      break;
+  if (sf == NULL)
+    {
+      sf = XNEW (struct size_by_file);
+      sf->file = file;
+      sf->bytes = 0;
+      sf->next = file_bytes;
+      file_bytes = sf;
+    }
+  sf->bytes += size;
+}
+
+static void
+print_size_line (FILE *f, const char *name, unsigned long bytes,
+                 unsigned long total)
+{
+  fprintf (f, "  %-24s %8lu  %5.1f%%\n", name, bytes,
+           total ? 100.0 * bytes / total : 0.0);
+}
+
+static void
+print_size_report (void)
+{
+  FILE *f = stderr;
+  struct size_by_file *sf;
+  unsigned long total = 0;
+  unsigned i;
+
+  for (i = 0; i < PREFIX_MAX; ++i)
+    total += prefix_bytes[i];
+
+  fprintf (f, _("Instruction bytes: %lu\n"), total);
+  fprintf (f, _("By mnemonic:\n"));
+  for (i = 0; i < ARRAY_SIZE (instab); ++i)
+    if (instab_bytes[i])
+      print_size_line (f, instab[i].name, instab_bytes[i], total);
+  fprintf (f, _("By prefix:\n"));
+  for (i = 0; i < PREFIX_MAX; ++i)
+    print_size_line (f, prefix_class_names[i], prefix_bytes[i], total);
+  if (ins_ok & INS_EZ80)
+    {
+      fprintf (f, _("By suffix:\n"));
+      for (i = 0; i < ARRAY_SIZE (suffix_names); ++i)
+        print_size_line (f, suffix_names[i], suffix_bytes[i], total);
+    }
+  fprintf (f, _("By source file:\n"));
+  for (sf = file_bytes; sf; sf = sf->next)
+    print_size_line (f, sf->file, sf->bytes, total);
+}
+
+/* Print the -z80-stats counters.  This runs at exit, after the
+   relocations have been processed.  */
+static void
+print_stats (void)
+{
+  FILE *f = stderr;
+  static const char *const class_names[] =
+    { "z80", "r800", "gbz80", "z180", "ez80", "z80n" };
+  unsigned long class_counts[ARRAY_SIZE (class_names) + 1];
+  const char *sep;
+  unsigned i, j;
+
+  memset (class_counts, 0, sizeof (class_counts));
+  for (i = 0; i < ARRAY_SIZE (instab); ++i)
+    if (instab[i].inss == INS_ALL)
+      class_counts[ARRAY_SIZE (class_names)] += instab_counts[i];
+    else
+      for (j = 0; j < ARRAY_SIZE (class_names); ++j)
+        if (instab[i].inss & (1 << j))
+          class_counts[j] += instab_counts[i];
+
+  if (stats_format == STATS_JSON)
+    {
+      fprintf (f, "{\"counters\": {");
+      for (sep = "", i = 0; i < STAT_MAX; ++i, sep = ", ")
+        fprintf (f, "%s\"%s\": %lu", sep, stat_names[i], stat_counts[i]);
+      fprintf (f, "}, \"instructions\": {");
+      for (sep = "", i = 0; i < ARRAY_SIZE (instab); ++i)
+        if (instab_counts[i])
+          {
+            fprintf (f, "%s\"%s\": %lu", sep, instab[i].name, instab_counts[i]);
+            sep = ", ";
+          }
+      fprintf (f, "}, \"classes\": {");
+      for (sep = "", i = 0; i < ARRAY_SIZE (class_names); ++i, sep = ", ")
+        fprintf (f, "%s\"%s\": %lu", sep, class_names[i], class_counts[i]);
+      fprintf (f, "%s\"all\": %lu}}\n", sep, class_counts[i]);
+      return;
+    }
+
+  fprintf (f, _("Z80 statistics:\n"));
+  for (i = 0; i < STAT_MAX; ++i)
+    fprintf (f, "  %-20s %lu\n", stat_names[i], stat_counts[i]);
+  fprintf (f, _("Instructions:\n"));
+  for (i = 0; i < ARRAY_SIZE (instab); ++i)
+    if (instab_counts[i])
+      fprintf (f, "  %-20s %lu\n", instab[i].name, instab_counts[i]);
+  fprintf (f, _("Instruction classes:\n"));
+  for (i = 0; i < ARRAY_SIZE (class_names); ++i)
+    fprintf (f, "  %-20s %lu\n", class_names[i], class_counts[i]);
+  fprintf (f, "  %-20s %lu\n", "all", class_counts[i]);
+}
+
+/* Encoding cache (see -encode-cache).  Lines whose operands name
+   nothing but registers, condition codes and numbers encode the same
+   way whenever the CPU state matches, so their bytes are replayed
+   from the cache instead of being parsed and encoded again.  Lines
+   that produce fixups or diagnostics are never cached.  */
+#define ENCODE_CACHE_MAGIC "Z80ENC2\n"
+#define ENCODE_CACHE_KEY_MAX 256
+#define ENCODE_CACHE_INSN_MAX 8
+
+struct encode_entry
+{
+  unsigned char size;
+  char bytes[ENCODE_CACHE_INSN_MAX];
+};
+
+static htab_t encode_cache;
+static int encode_cache_dirty;
+
+/* Return non-zero if every name in the operands of STR is a register
+   or a condition code.  */
+static int
+encode_cacheable (const char *str)
+{
+  const char *p = skip_space (str);
+  char name[BUFLEN + 1];
+  const char *name_key = name;
+
+  while (ISALNUM (*p) || *p == '.')
+    ++p;
+  for (; *p; ++p)
+    {
+      if (*p == '$' || *p == '"' || *p == '\'')
+        return 0;
+      if (ISDIGIT (*p))
+        {
+          while (is_part_of_name (p[1]))
+            if (*++p == '$')
+              return 0;
+        }
+      else if (is_name_beginner (*p))
+        {
+          unsigned i = 0;
+
+          for (; is_part_of_name (*p); ++p)
+            {
+              if (i == BUFLEN)
+                return 0;
+              name[i++] = TOLOWER (*p);
+            }
+          name[i] = 0;
+          --p;
+          if (!bsearch (&name_key, regtable, ARRAY_SIZE (regtable),
+                        sizeof (regtable[0]), key_cmp)
+              && !bsearch (&name_key, cc_tab, ARRAY_SIZE (cc_tab),
+                           sizeof (cc_tab[0]), key_cmp))
+            return 0;
+        }
+    }
+  return 1;
+}
+
+/* Build the cache key of STR in KEYBUF.  Return 0 if STR cannot be
+   cached.  */
+static int
+encode_cache_key (const char *str, char *keybuf)
+{
+  int len = snprintf (keybuf, ENCODE_CACHE_KEY_MAX, "%x:%x:%x:%d:%d:%d%d%d:%s",
+                      ins_ok, ins_err, ins_warn, cpu_mode, sdcc_compat,
+                      flag_no_warnings, synthetic_insns, auto_suffix, str);
+
+  return len > 0 && len < ENCODE_CACHE_KEY_MAX && encode_cacheable (str);
+}
+
+static void
+encode_cache_insert (const char *keystr, const char *bytes, int size)
+{
+  struct encode_entry *e = XNEW (struct encode_entry);
+
+  e->size = size;
+  memcpy (e->bytes, bytes, size);
+  str_hash_insert (encode_cache, xstrdup (keystr), e, 1);
+}
+
+static int
+replay_cached_insn (const char *keystr)
+{
+  struct encode_entry *e = str_hash_find (encode_cache, keystr);
+
+  if (e == NULL)
+    return 0;
+
+  memcpy (frag_more (e->size), e->bytes, e->size);
+  return 1;
+}
+
+/* The number of warnings issued or hidden so far.  A line on which a
+   warning was hidden must not be cached, or a later run would replay
+   it silently even where the warning would be printed.  */
+static unsigned long
+warnings_seen (void)
+{
+  return had_warnings () + diag_hidden;
+}
+
+/* Return non-zero if the cache may be used for the current line.  The
+   cache holds bytes only, so it is bypassed while an option has to
+   see each instruction as it is assembled.  */
+static int
+encode_cache_usable (void)
+{
+  return encode_cache != NULL && !check_target_count
+         && index_fold == INDEX_FOLD_NONE && !size_report
+         && stats_format == STATS_NONE;
+}
+
+static void
+remember_insn (const char *keystr, fragS *start, int where,
+               fixS *fix_tail, int errors, unsigned long warnings)
+{
+  int size;
+
+  if (start != frag_now
+      || (inst_mode & INST_MODE_FORCED)
+      || frchain_now->fix_tail != fix_tail
+      || had_errors () != errors
+      || warnings_seen () != warnings)
+    return;
+
+  size = frag_now_fix () - where;
+  if (size <= 0 || size > ENCODE_CACHE_INSN_MAX)
+    return;
+
+  encode_cache_insert (keystr, frag_now->fr_literal + where, size);
+  encode_cache_dirty = 1;
+}
+
+static void
+load_encode_cache (void)
+{
+  char magic[sizeof (ENCODE_CACHE_MAGIC) - 1];
+  char keystr[ENCODE_CACHE_KEY_MAX];
+  char bytes[ENCODE_CACHE_INSN_MAX];
+  unsigned char len[2];
+  int size;
+  FILE *f;
+
+  encode_cache = str_htab_create ();
+  f = fopen (encode_cache_file, FOPEN_RB);
+  if (f == NULL)
+    return;
+
+  if (fread (magic, sizeof (magic), 1, f) != 1
+      || memcmp (magic, ENCODE_CACHE_MAGIC, sizeof (magic)) != 0)
+    {
+      as_warn (_("ignoring invalid encoding cache `%s'"), encode_cache_file);
+      fclose (f);
+      return;
+    }
+
+  while (fread (len, sizeof (len), 1, f) == 1)
+    {
+      unsigned keylen = len[0] | (len[1] << 8);
+
+      if (keylen >= ENCODE_CACHE_KEY_MAX
+          || fread (keystr, keylen, 1, f) != 1
+          || (size = getc (f)) == EOF
+          || size == 0 || size > ENCODE_CACHE_INSN_MAX
+          || fread (bytes, size, 1, f) != 1)
+        {
+          as_warn (_("ignoring truncated encoding cache `%s'"),
+                   encode_cache_file);
+          break;
+        }
+      keystr[keylen] = 0;
+      encode_cache_insert (keystr, bytes, size);
+    }
+  fclose (f);
+}
+
+static int
+save_encode_cache_entry (void **slot, void *arg)
+{
+  string_tuple_t *tuple = *(string_tuple_t **) slot;
+  const struct encode_entry *e = tuple->value;
+  size_t keylen = strlen (tuple->key);
+  FILE *f = arg;
+
+  putc (keylen & 0xFF, f);
+  putc (keylen >> 8, f);
+  fwrite (tuple->key, keylen, 1, f);
+  putc (e->size, f);
+  fwrite (e->bytes, e->size, 1, f);
+  return 1;
+}
+
+static void
+save_encode_cache (void)
+{
+  FILE *f;
+
+  if (!encode_cache_dirty || had_errors ())
+    return;
+
+  f = fopen (encode_cache_file, FOPEN_WB);
+  if (f == NULL)
+    {
+      as_warn (_("cannot write encoding cache `%s': %s"), encode_cache_file,
+               xstrerror (errno));
+      return;
+    }
+  fwrite (ENCODE_CACHE_MAGIC, sizeof (ENCODE_CACHE_MAGIC) - 1, 1, f);
+  htab_traverse_noresize (encode_cache, save_encode_cache_entry, f);
+  if (fclose (f) != 0)
+    as_warn (_("cannot write encoding cache `%s': %s"), encode_cache_file,
+             xstrerror (errno));
+}
+
+/* Index displacement folding.  SDCC frame code reads and writes 16-bit
+   locals as two 8-bit accesses: ld l,(ix+d) and ld h,(ix+d+1), and
+   likewise for de and bc and for stores.  On the eZ80 in Z80 mode one
+   ld rr,(ix+d) or ld (ix+d),rr does the same in 3 bytes less.  Each
+   instruction is compared with the one assembled just before it, if
+   both have constant displacements and nothing, not even a label or
+   a directive such as x = ., comes between them (see
+   z80_start_line_hook).  In ADL mode the 16-bit forms move 24 bits, so
+   no pair is folded there.  */
+
+static struct
+{
+  fragS *frag;
+  int where;
+  int end;
+} last_insn;
+
+static const struct
+{
+  unsigned char lo;
+  unsigned char hi;
+  unsigned char op16;
+  const char *reg;
+} fold_pairs[] =
+{
+  { 0x6E, 0x66, 0x27, "hl" }, /* ld l,(ii+d); ld h,(ii+d+1) */
+  { 0x5E, 0x56, 0x17, "de" },
+  { 0x4E, 0x46, 0x07, "bc" },
+  { 0x75, 0x74, 0x2F, "hl" }, /* ld (ii+d),l; ld (ii+d+1),h */
+  { 0x73, 0x72, 0x1F, "de" },
+  { 0x71, 0x70, 0x0F, "bc" },
+};
+
+/* The last instruction, if it was a call (see fuse_call).  */
+static struct
+{
+  fragS *frag;
+  int where;
+  int end;
+} last_call;
+
+static void
+forget_last_insn (void)
+{
+  last_insn.frag = NULL;
+  last_call.frag = NULL;
+}
+
+/* Check whether the line at S may define a label: anything starting
+   in the first column with a name or an SDCC local label, or an
+   indented name followed by a colon.  */
+static int
+has_label (const char *s)
+{
+  const char *p = skip_space (s);
+  const char *name = p;
+
+  if (p == s)
+    return is_name_beginner (*s) || ISDIGIT (*s);
+  while (is_part_of_name (*p))
+    ++p;
+  return p != name && *p == ':';
+}
+
+/* Return the index in fold_pairs of the pair made up of the 3-byte
+   indexed accesses PREV and CUR, or -1.  *DISP receives the
+   displacement of the low byte.  */
+static int
+find_fold_pair (const unsigned char *prev, const unsigned char *cur,
+                int *disp)
+{
+  unsigned i;
+
+  if (prev[0] != cur[0] || (prev[0] != 0xDD && prev[0] != 0xFD))
+    return -1;
+
+  for (i = 0; i < ARRAY_SIZE (fold_pairs); ++i)
+    {
+      if (prev[1] == fold_pairs[i].lo && cur[1] == fold_pairs[i].hi
+          && (signed char) prev[2] + 1 == (signed char) cur[2])
+        *disp = (signed char) prev[2];
+      else if (prev[1] == fold_pairs[i].hi && cur[1] == fold_pairs[i].lo
+               && (signed char) cur[2] + 1 == (signed char) prev[2])
+        *disp = (signed char) cur[2];
+      else
+        continue;
+      return i;
+    }
+  return -1;
+}
+
+static void
+fold_index_pair (fragS *start, int where, fixS *fix_tail)
+{
+  int end = frag_now_fix ();
+  unsigned char *prev, *cur;
+  int disp, i;
+
+  if (start != frag_now || end - where != 3 || err_flag
+      || frchain_now->fix_tail != fix_tail
+      || !(ins_ok & INS_EZ80) || cpu_mode || (inst_mode & INST_MODE_FORCED))
+    {
+      forget_last_insn ();
+      return;
+    }
+
+  cur = (unsigned char *) frag_now->fr_literal + where;
+  if (last_insn.frag == frag_now && last_insn.end == where)
+    {
+      prev = (unsigned char *) frag_now->fr_literal + last_insn.where;
+      i = find_fold_pair (prev, cur, &disp);
+      if (i >= 0)
+        {
+          const char *ii = prev[0] == 0xDD ? "ix" : "iy";
+
+          if (index_fold == INDEX_FOLD_REPORT)
+            {
+              if (warn_enabled (DIAG_INDEX_FOLD))
+                {
+                  if ((fold_pairs[i].lo & 0xF8) == 0x70)
+                    as_warn (_("this and the previous instruction can be "
+                               "assembled as `ld (%s%+d),%s'"),
+                             ii, disp, fold_pairs[i].reg);
+                  else
+                    as_warn (_("this and the previous instruction can be "
+                               "assembled as `ld %s,(%s%+d)'"),
+                             fold_pairs[i].reg, ii, disp);
+                }
+            }
+          else
+            {
+              prev[1] = fold_pairs[i].op16;
+              prev[2] = disp;
+              obstack_blank_fast (&frchain_now->frch_obstack, -3);
+            }
+          forget_last_insn ();
+          return;
+        }
+    }
+
+  last_insn.frag = frag_now;
+  last_insn.where = where;
+  last_insn.end = end;
+}
+
+/* Unreachable code.  Instructions assembled after an unconditional
+   jp, jr, ret, reti or retn and before the next label can never run,
+   unless a jump to a constant or $-relative address reaches them.
+   Such a jump pins the range it is in or that follows it; one that
+   comes after the range cannot be seen.  Ranges are counted one per
+   label and reported at the line of the first instruction.
+
+   With -unreachable=drop a range is removed when the label ending it
+   is seen, if it consists of instructions only, needs no fixups and
+   lies in one frag.  Until then the line entries and mapping symbols
+   of its instructions are held back, and emitted if it is kept.  Any
+   other line in the range keeps it, so data directives, commonly jump
+   tables, are left alone.  */
+
+/* bytes reserved for a range that may be dropped, so that it stays in
+   one frag */
+#define UNREACHABLE_DROP_MAX 256
+#define UNREACHABLE_INSN_MAX 16
+
+struct pending_insn
+{
+  int where;
+  enum mapping_state map;
+  struct dwarf2_line_info loc;
+};
+
+static struct
+{
+  int active;
+  int pinned;
+  int keep;
+  segT seg;
+  const char *file;
+  unsigned int line;
+  unsigned long bytes;
+  unsigned long dropped;
+  /* the range held back for -unreachable=drop, at START in FRAG */
+  fragS *frag;
+  int start;
+  int size;
+  struct pending_insn *pending;
+  unsigned npending;
+  unsigned alloc;
+} unreachable;
+
+static int
+unreachable_pending (void)
+{
+  return unreachable.npending != 0;
+}
+
+/* Keep the range held back for -unreachable=drop, and the rest of it.  */
+static void
+keep_unreachable (void)
+{
+  unsigned i;
+
+  for (i = 0; i < unreachable.npending; ++i)
+    {
+      struct pending_insn *pi = &unreachable.pending[i];
+
+      mapping_state (pi->map, unreachable.frag, pi->where);
+      if (frag_now == unreachable.frag)
+        dwarf2_gen_line_info (pi->where, &pi->loc);
+    }
+  unreachable.npending = 0;
+  unreachable.frag = NULL;
+  unreachable.keep = 1;
+}
+
+/* Hold back the line entry and mapping symbol of the SIZE bytes at
+   WHERE, which may be dropped.  */
+static void
+defer_unreachable (int where, int size, enum mapping_state map)
+{
+  struct pending_insn *pi;
+
+  if (unreachable.npending == unreachable.alloc)
+    {
+      unreachable.alloc = unreachable.alloc ? unreachable.alloc * 2 : 16;
+      unreachable.pending = XRESIZEVEC (struct pending_insn,
+                                        unreachable.pending,
+                                        unreachable.alloc);
+    }
+  pi = &unreachable.pending[unreachable.npending++];
+  pi->where = where;
+  pi->map = map;
+  memset (&pi->loc, 0, sizeof (pi->loc));
+  if (debug_type == DEBUG_DWARF2 || dwarf2_loc_directive_seen)
+    dwarf2_where (&pi->loc);
+  dwarf2_consume_line_info ();
+
+  unreachable.size += size;
+  if (unreachable.size > UNREACHABLE_DROP_MAX - UNREACHABLE_INSN_MAX)
+    keep_unreachable ();
+}
+
+/* Note a jump to a constant or $-relative address, which may reach
+   unreachable code.  */
+static void
+pin_unreachable (void)
+{
+  unreachable.pinned = 1;
+  if (unreachable.active)
+    keep_unreachable ();
+}
+
+/* Return non-zero if the jump or call NAME with operands ARGS has a
+   constant or $-relative target.  */
+static int
+has_fixed_target (const char *name, const char *args)
+{
+  const char *p;
+
+  if (strcmp (name, "jp") && strcmp (name, "jr")
+      && strcmp (name, "call") && strcmp (name, "djnz"))
+    return 0;
+
+  p = strrchr (args, ',');
+  p = skip_space (p ? p + 1 : args);
+  return ISDIGIT (*p) || strchr (p, '$') != NULL;
+}
+
+static int
+is_unconditional_transfer (const unsigned char b[2])
+{
+  switch (b[0])
+    {
+    case 0xC3: /* jp nn */
+    case 0xC9: /* ret */
+    case 0x18: /* jr e */
+    case 0xE9: /* jp (hl) */
+      return 1;
+    case 0xDD:
+    case 0xFD:
+      return b[1] == 0xE9;
+    case 0xED:
+      return b[1] == 0x4D || b[1] == 0x45
+        || (b[1] == 0x98 && (ins_ok & INS_Z80N));
+    case 0xD9: /* reti on GameBoy, exx elsewhere */
+      return (ins_ok & INS_GBZ80) != 0;
+    default:
+      return 0;
+    }
+}
+
+/* End the current unreachable range, at a label if AT_LABEL.  */
+static void
+end_unreachable (int at_label)
+{
+  if (unreachable.npending)
+    {
+      if (at_label && frag_now == unreachable.frag
+          && frag_now_fix () == unreachable.start + unreachable.size)
+        {
+          obstack_blank_fast (&frchain_now->frch_obstack, -unreachable.size);
+          unreachable.dropped = unreachable.size;
+          unreachable.npending = 0;
+          unreachable.frag = NULL;
+          forget_last_insn ();
+        }
+      else
+        keep_unreachable ();
+    }
+
+  if (unreachable.active && unreachable.bytes)
+    {
+      if (unreachable.dropped)
+        as_warn_where (unreachable.file, unreachable.line,
+                       _("%lu unreachable bytes, %lu of them dropped"),
+                       unreachable.bytes, unreachable.dropped);
+      else
+        as_warn_where (unreachable.file, unreachable.line,
+                       _("%lu unreachable bytes"), unreachable.bytes);
+    }
+  unreachable.active = 0;
+  unreachable.pinned = 0;
+}
+
+/* Track the instruction assembled at WHERE in START.  Return non-zero
+   if it may be dropped by -unreachable=drop; emit_insn_line then holds
+   back its line entry and mapping symbol.  */
+static int
+track_reachability (fragS *start, int where, fixS *fix_tail, int forced)
+{
+  unsigned char b[2];
+  int size;
+
+  if (unreachable.active && unreachable.seg != now_seg)
+    end_unreachable (0);
+
+  size = bytes_emitted_since (start, where, forced, b);
+  if (!unreachable.active)
+    {
+      if (is_unconditional_transfer (b))
+        {
+          unreachable.active = 1;
+          unreachable.keep = unreachable.pinned;
+          unreachable.seg = now_seg;
+          unreachable.bytes = 0;
+          unreachable.dropped = 0;
+          unreachable.frag = NULL;
+          unreachable.size = 0;
+          if (unreachable_mode == UNREACHABLE_DROP && !unreachable.keep)
+            frag_grow (UNREACHABLE_DROP_MAX);
+        }
+      return 0;
+    }
+
+  if (unreachable.bytes == 0)
+    unreachable.file = as_where (&unreachable.line);
+  unreachable.bytes += size;
+  if (unreachable_mode != UNREACHABLE_DROP || unreachable.keep)
+    return 0;
+
+  if (start == frag_now && frchain_now->fix_tail == fix_tail && !err_flag
+      && (unreachable.frag == NULL
+          || (unreachable.frag == frag_now
+              && where == unreachable.start + unreachable.size)))
+    {
+      if (unreachable.frag == NULL)
+        {
+          unreachable.frag = frag_now;
+          unreachable.start = where;
+        }
+      return 1;
+    }
+
+  keep_unreachable ();
+  return 0;
+}
+
+/* Call/ret fusion.  A call immediately followed by ret, with no label
+   or directive between them, returns to the caller's caller, so call nn; ret becomes
+   jp nn: 1 byte and 17 T-states less.  call cc,nn; ret becomes
+   jp cc,nn; ret, which is as long but saves the push and pop of the
+   return address when the condition holds.  Instructions with a mode
+   suffix are left alone, as an eZ80 mixed-mode call also switches the
+   return mode.  */
+
+static void
+fuse_call (fragS *start, int where)
+{
+  int end = frag_now_fix ();
+  unsigned char *call;
+  unsigned char op;
+
+  if (start != frag_now || end == where || err_flag
+      || (inst_mode & INST_MODE_FORCED))
+    {
+      last_call.frag = NULL;
+      return;
+    }
+
+  op = frag_now->fr_literal[where];
+  if (op == 0xCD || (op & 0xC7) == 0xC4)
+    {
+      last_call.frag = frag_now;
+      last_call.where = where;
+      last_call.end = end;
+      return;
+    }
+
+  if (op == 0xC9 && end - where == 1
+      && last_call.frag == frag_now && last_call.end == where)
+    {
+      call = (unsigned char *) frag_now->fr_literal + last_call.where;
+      if (*call == 0xCD)
+        {
+          *call = 0xC3;
+          obstack_blank_fast (&frchain_now->frch_obstack, -1);
+          if (warn_enabled (DIAG_CALL_RET))
+            as_warn (_("call and ret fused into jp"));
+        }
+      else
+        {
+          *call = *call - 0xC4 + 0xC2;
+          if (warn_enabled (DIAG_CALL_RET))
+            as_warn (_("conditional call before ret assembled as jp"));
+        }
+    }
+  last_call.frag = NULL;
+}
+
+/* Synthetic instructions (-synthetic).  Each is expanded to the
+   fastest sequence the selected CPU allows; the T-states below are
+   those of the Z80 in Z80 mode.
+     ld rr,rr'   eZ80 lea rr,ii+0 from an index register (3 bytes);
+                 ld r,r' twice (8 T), or with ixh/ixl (16 T);
+                 push rr'; pop rr (21 T, 29 T for index registers) in
+                 ADL mode, where 8-bit moves would leave the upper byte
+   sub hl,rr     or a; sbc hl,rr (19 T)
+   sla hl        add hl,hl outside ADL mode (11 T)
+   sla/sra/srl/rl/rr rr
+                 two 8-bit shifts or rotates through carry (16 T)
+   mul d,e       mlt de on the Z180 and eZ80 (Z80N has mul d,e)
+   Synthetic forms are tried before the real instructions, but only for
+   operand combinations that none of them accepts, so the meaning of
+   valid source never changes.  */
+
+static int
+get_pair (const struct operand_vec *ops, int i)
+{
+  int rnum;
+
+  if (ops->kind[i] != OPK_REG)
+    return -1;
+  rnum = ops->exp[i].X_add_number;
+  switch (rnum & ~R_INDEX)
+    {
+    case REG_BC:
+    case REG_DE:
+      return (rnum & R_INDEX) ? -1 : rnum;
+    case REG_HL:
+      return rnum;
+    default:
+      return -1;
+    }
+}
+
+static void
+emit_push_pop_pair (int opcode, int rnum)
+{
+  char *q = frag_more ((rnum & R_INDEX) ? 2 : 1);
+
+  if (rnum & R_INDEX)
+    *q++ = (rnum & R_IX) ? 0xDD : 0xFD;
+  *q = opcode + ((rnum & 3) << 4);
+}
+
+static int
+synth_ld (struct operand_vec *ops)
+{
+  int dst, src;
+  char *q;
+
+  if (ops->count != 2 || (dst = get_pair (ops, 0)) < 0
+      || (src = get_pair (ops, 1)) < 0 || dst == src)
+    return 0;
+
+  if ((ins_ok & INS_EZ80) && (src & R_INDEX))
+    {
+      static const unsigned char lea_ix[] = { 0x02, 0x12, 0x22 };
+      static const unsigned char lea_iy[] = { 0x03, 0x13, 0x23 };
+
+      q = frag_more (3);
+      q[0] = 0xED;
+      if (dst & R_INDEX)
+        q[1] = (src & R_IX) ? 0x55 : 0x54;
+      else
+        q[1] = (src & R_IX) ? lea_ix[dst & 3] : lea_iy[dst & 3];
+      q[2] = 0;
+      return 1;
+    }
+
+  if (!(inst_mode & INST_MODE_L) && !((dst | src) & R_INDEX))
+    {
+      q = frag_more (2);
+      q[0] = 0x40 | (((dst & 3) * 2) << 3) | ((src & 3) * 2);
+      q[1] = 0x40 | (((dst & 3) * 2 + 1) << 3) | ((src & 3) * 2 + 1);
+      return 1;
+    }
+
+  if (!(inst_mode & INST_MODE_L)
+      && ((dst & R_INDEX) != 0) != ((src & R_INDEX) != 0)
+      && ((dst & R_INDEX) ? src : dst) != REG_HL
+      && (INS_IDX_HALF & ins_ok & gate_silent))
+    {
+      /* An index register and bc or de: through ixh/ixl.  */
+      int ii = (dst | src) & R_INDEX;
+      int d = (dst & R_INDEX) ? 4 : (dst & 3) * 2;
+      int s = (src & R_INDEX) ? 4 : (src & 3) * 2;
+
+      q = frag_more (4);
+      q[0] = q[2] = (ii & R_IX) ? 0xDD : 0xFD;
+      q[1] = 0x40 | (d << 3) | s;
+      q[3] = 0x40 | ((d + 1) << 3) | (s + 1);
+      return 1;
+    }
+
+  emit_push_pop_pair (0xC5, src);
+  emit_push_pop_pair (0xC1, dst);
+  return 1;
+}
+
+static int
+synth_sub (struct operand_vec *ops)
+{
+  char *q;
+  int src;
+
+  if (ops->count != 2 || (ins_ok & INS_GBZ80) || ops->kind[0] != OPK_REG
+      || ops->exp[0].X_add_number != REG_HL || ops->kind[1] != OPK_REG)
+    return 0;
+  src = ops->exp[1].X_add_number;
+  if (src != REG_BC && src != REG_DE && src != REG_HL && src != REG_SP)
+    return 0;
+
+  q = frag_more (3);
+  q[0] = 0xB7;
+  q[1] = 0xED;
+  q[2] = 0x42 | ((src & 3) << 4);
+  return 1;
+}
+
+static int
+synth_shift (struct operand_vec *ops)
+{
+  int rnum, hi, lo;
+  char *q;
+
+  if (ops->count != 1 || (rnum = get_pair (ops, 0)) < 0 || (rnum & R_INDEX))
+    return 0;
+  hi = (rnum & 3) * 2;
+  lo = hi + 1;
+
+  if (strcmp (buf, "sla") == 0 && rnum == REG_HL
+      && !(inst_mode & INST_MODE_L))
+    {
+      *frag_more (1) = 0x29;
+      return 1;
+    }
+
+  q = frag_more (4);
+  q[0] = q[2] = 0xCB;
+  if (strcmp (buf, "sla") == 0)
+    {
+      q[1] = 0x20 + lo;
+      q[3] = 0x10 + hi;
+    }
+  else if (strcmp (buf, "rl") == 0)
+    {
+      q[1] = 0x10 + lo;
+      q[3] = 0x10 + hi;
+    }
+  else
+    {
+      q[1] = (strcmp (buf, "sra") == 0 ? 0x28
+              : strcmp (buf, "srl") == 0 ? 0x38 : 0x18) + hi;
+      q[3] = 0x18 + lo;
+    }
+  return 1;
+}
+
+static int
+synth_mul (struct operand_vec *ops)
+{
+  char *q;
+
+  if (ops->count != 2 || (ins_ok & INS_Z80N)
+      || !(ins_ok & (INS_Z180 | INS_EZ80))
+      || ops->kind[0] != OPK_REG || ops->exp[0].X_add_number != REG_D
+      || ops->kind[1] != OPK_REG || ops->exp[1].X_add_number != REG_E)
+    return 0;
+
+  q = frag_more (2);
+  q[0] = 0xED;
+  q[1] = 0x5C;
+  return 1;
+}
+
+struct synth_entry
+{
+  const char *name;
+  int (*fp) (struct operand_vec *);
+};
+
+static const struct synth_entry synth_tab[] =
+{
+  { "ld",  synth_ld },
+  { "mul", synth_mul },
+  { "rl",  synth_shift },
+  { "rr",  synth_shift },
+  { "sla", synth_shift },
+  { "sra", synth_shift },
+  { "srl", synth_shift },
+  { "sub", synth_sub },
+};
+
+/* Return nonzero if ARGS is a list of plain names, so that parsing it
+   cannot report errors the real instruction would not.  */
+static int
+is_name_list (const char *args)
+{
+  const char *p = skip_space (args);
+
+  for (;;)
+    {
+      if (!is_name_beginner (*p))
+        return 0;
+      while (is_part_of_name (*p))
+        ++p;
+      p = skip_space (p);
+      if (*p == 0)
+        return 1;
+      if (*p++ != ',')
+        return 0;
+      p = skip_space (p);
+    }
+}
+
+/* Try to assemble the instruction named in BUF with operands ARGS as a
+   synthetic one.  Return nonzero if it was one.  */
+static int
+emit_synthetic (const char *args)
+{
+  struct operand_vec ops;
+  const struct synth_entry *sp;
+  const char *name = buf;
+
+  sp = bsearch (&name, synth_tab, ARRAY_SIZE (synth_tab),
+                sizeof (synth_tab[0]), key_cmp);
+  if (sp == NULL || !is_name_list (args))
+    return 0;
+
+  parse_operands (args, &ops);
+  return !err_flag && sp->fp (&ops);
+}
+
+/* Return non-zero if the line S is empty or holds an instruction.  */
+static int
+is_insn_line (const char *s)
+{
+  char name[BUFLEN];
+  const char *key = name;
+  unsigned i;
+
+  s = skip_space (s);
+  if (*s == 0 || *s == '\n' || *s == ';')
+    return 1;
+  for (i = 0; i < BUFLEN - 1 && ISALNUM (s[i]); ++i)
+    name[i] = TOLOWER (s[i]);
+  name[i] = 0;
+  return bsearch (&key, cpu_instab, cpu_instab_size, sizeof (cpu_instab[0]),
+                  key_cmp) != NULL
+    || (synthetic_insns
+        && bsearch (&key, synth_tab, ARRAY_SIZE (synth_tab),
+                    sizeof (synth_tab[0]), key_cmp) != NULL);
+}
+
+/* Emit the mapping symbol MAP and the line number entry of the
+   instruction assembled at WHERE in START, or hold them back if DEFER
+   (see track_reachability).  This is done last, so that the entry
+   covers the bytes -index-fold and -fuse-call-ret left of the
+   instruction; none for an instruction they removed entirely.  */
+static void
+emit_insn_line (fragS *start, int where, enum mapping_state map, int defer)
+{
+  unsigned char b[2];
+  int size = bytes_emitted_since (start, where, 0, b);
+
+  if (size <= 0)
+    dwarf2_consume_line_info ();
+  else if (defer)
+    defer_unreachable (where, size, map);
+  else
+    {
+      mapping_state (map, start, where);
+      dwarf2_emit_insn (size);
+    }
+}
 
 void
 md_assemble (char *str)
@@ -4815,9 +8012,42 @@ md_assemble (char *str)
   const char *p;
   char * old_ptr;
   table_t *insp;
-
+  fragS *start_frag;
+  int start_where;
+  char cache_key[ENCODE_CACHE_KEY_MAX];
+  int cacheable = 0;
+  fixS *fix_tail = NULL;
+  int errors = 0;
+  unsigned long warnings = 0;
+  int defer = 0;
+
+  ++stat_counts[STAT_MD_ASSEMBLE];
   err_flag = 0;
   inst_mode = cpu_mode ? (INST_MODE_L | INST_MODE_IL) : (INST_MODE_S | INST_MODE_IS);
+  if (encode_cache_usable ())
+    {
+      cacheable = encode_cache_key (str, cache_key);
+      if (cacheable)
+        {
+          start_frag = frag_now;
+          start_where = frag_now_fix ();
+          if (replay_cached_insn (cache_key))
+            {
+              if (unreachable_mode)
+                defer = track_reachability (start_frag, start_where,
+                                            frchain_now->fix_tail, 0);
+              if (fuse_call_ret)
+                fuse_call (start_frag, start_where);
+              emit_insn_line (start_frag, start_where, get_mapping_state (0),
+                              defer);
+              return;
+            }
+        }
+      errors = had_errors ();
+      warnings = warnings_seen ();
+    }
+  fix_tail = frchain_now->fix_tail;
+
   old_ptr = input_line_pointer;
   p = skip_space (str);
   
@@ -4830,10 +8060,13 @@ md_assemble (char *str)
       return;
     }
 
-  dwarf2_emit_insn (0);
+  start_frag = frag_now;
+  start_where = frag_now_fix ();
   
   if (!validate_syntax(&p))
     {
+      emit_insn_line (start_frag, start_where,
+                      get_mapping_state (inst_mode), 0);
       input_line_pointer = old_ptr;
       return;
     }
@@ -4842,19 +8075,51 @@ md_assemble (char *str)
   p = skip_space (p);
   key = buf;
 
-  insp = bsearch (&key, instab, ARRAY_SIZE (instab),
-                sizeof (instab[0]), key_cmp);
+  insp = bsearch (&key, cpu_instab, cpu_instab_size,
+                  sizeof (cpu_instab[0]), key_cmp);
   
-  if (!is_instruction_valid(insp))
+  if (unreachable_mode == UNREACHABLE_DROP && has_fixed_target (buf, p))
+    pin_unreachable ();
+
+  if (synthetic_insns && emit_synthetic (p))
+    {
+      forget_last_insn ();
+      if (unreachable_mode)
+        defer = track_reachability (start_frag, start_where, fix_tail,
+                                    (inst_mode & INST_MODE_FORCED) != 0);
+    }
+  else if (insp == NULL)
     {
       *frag_more (1) = 0;
       as_bad (_("Unknown instruction `%s'"), buf);
     }
   else
     {
+      size_t insn = cpu_instab_index[insp - cpu_instab];
+
+      ++instab_counts[insn];
+      if (cpu_instab_warn[insp - cpu_instab]
+          && warn_enabled (ins_class_kind (insp->inss & ins_ok)))
+        as_warn ("%s", ins_class_message (insp->inss & ins_ok));
       p = process_instruction(insp, p);
-    }
-  
+      if (check_target_count)
+        check_instruction_targets (insp);
+      if (index_fold)
+        fold_index_pair (start_frag, start_where, fix_tail);
+      if (unreachable_mode)
+        defer = track_reachability (start_frag, start_where, fix_tail,
+                                    (inst_mode & INST_MODE_FORCED) != 0);
+      if (fuse_call_ret)
+        fuse_call (start_frag, start_where);
+      if (size_report)
+        record_insn_size (insn, start_frag, start_where);
+      if (cacheable)
+        remember_insn (cache_key, start_frag, start_where,
+                       fix_tail, errors, warnings);
+    }
+  
+  emit_insn_line (start_frag, start_where, get_mapping_state (inst_mode),
+                  defer);
   input_line_pointer = old_ptr;
 }
 
@@ -4891,9 +8156,92 @@ static int is_instruction_valid(table_t *insp)
   return insp && (!insp->inss || (insp->inss & ins_ok));
 }
 
+/* Resolve emitters whose choice of encoding depends on the CPU alone.  */
+static void specialize_insn(table_t *t)
+{
+  if (t->fp == emit_sub && !(ins_ok & INS_GBZ80))
+    t->fp = emit_s;
+  else if (t->fp == emit_lddldi && !(ins_ok & INS_GBZ80))
+    t->fp = emit_insn;
+  else if (t->fp == emit_swap && !(ins_ok & INS_Z80N))
+    t->fp = emit_mr;
+  else if (t->fp == emit_reti)
+    {
+      if (ins_ok & INS_GBZ80)
+        {
+          t->prefix = 0x00;
+          t->opcode = 0xD9;
+        }
+      t->fp = emit_insn;
+    }
+}
+
+/* Build the dispatch table for the selected CPU: the instab entries
+   valid for INS_OK, specialized by specialize_insn.  It keeps instab
+   order, so it can be searched with bsearch as well; CPU_INSTAB_INDEX
+   maps its entries back to instab for the statistics, and
+   CPU_INSTAB_WARN marks mnemonics the ISA gate only accepts with a
+   warning.  */
+static void build_cpu_instab(void)
+{
+  size_t i;
+
+  cpu_instab_size = 0;
+  for (i = 0; i < ARRAY_SIZE (instab); ++i)
+    if (is_instruction_valid (&instab[i]))
+      {
+        cpu_instab[cpu_instab_size] = instab[i];
+        specialize_insn (&cpu_instab[cpu_instab_size]);
+        cpu_instab_warn[cpu_instab_size] =
+          instab[i].inss && !(instab[i].inss & gate_silent);
+        cpu_instab_index[cpu_instab_size++] = i;
+      }
+}
+
+/* Report the instruction to every -check-march target that lacks its
+   mnemonic or one of the classes check_mach saw while assembling it.  */
+static void check_instruction_targets(const table_t *insp)
+{
+  unsigned i;
+  int show = -1;
+
+  for (i = 0; i < check_target_count; ++i)
+    if (check_targets[i].failed
+        || (insp->inss && !(insp->inss & check_targets[i].ins_ok)))
+      {
+        check_targets[i].failed = 0;
+        ++check_targets[i].failures;
+        if (show < 0)
+          show = warn_enabled (DIAG_CHECK_MARCH);
+        if (show)
+          as_warn (_("instruction `%s' is not supported by %s"),
+                   insp->name, check_targets[i].name);
+      }
+}
+
+static void
+report_check_targets (void)
+{
+  unsigned i;
+
+  for (i = 0; i < check_target_count; ++i)
+    if (check_targets[i].failures)
+      as_warn (_("%lu instructions are not supported by %s"),
+               check_targets[i].failures, check_targets[i].name);
+}
+
 static const char* process_instruction(table_t *insp, const char *p)
 {
-  p = insp->fp (insp->prefix, insp->opcode, p);
+  if (insp->fp2)
+    {
+      struct operand_vec ops;
+
+      p = parse_operands (p, &ops);
+      if (!err_flag)
+        insp->fp2 (insp->prefix, insp->opcode, &ops);
+    }
+  else
+    p = insp->fp (insp->prefix, insp->opcode, p);
   p = skip_space (p);
   if ((!err_flag) && *p)
     as_bad (_("junk at end of line, "
@@ -4923,12 +8271,60 @@ is_overflow (long value, unsigned bitsize)
   return value < 0 ? signed_overflow (value, bitsize) : unsigned_overflow (value, bitsize);
 }
 
+/* How md_apply_fix stores and checks a value for each relocation.  */
+enum reloc_check
+{
+  RELOC_CHECK_NONE,	/* Truncate silently.  */
+  RELOC_CHECK_GENERIC,	/* Leave the check to the generic code.  */
+  RELOC_CHECK_WARN,	/* Warn if the value does not fit.  */
+  RELOC_CHECK_SIGNED	/* Error if not a signed 8-bit value.  */
+};
+
+struct reloc_desc
+{
+  bfd_reloc_code_real_type type;
+  unsigned char size;		/* Bytes stored.  */
+  unsigned char shift;		/* Right shift applied to the value.  */
+  unsigned char big_endian;
+  unsigned char check;		/* enum reloc_check.  */
+};
+
+static const struct reloc_desc reloc_desc_table[] =
+{
+  { BFD_RELOC_8,	   1,  0, 0, RELOC_CHECK_WARN },
+  { BFD_RELOC_16,	   2,  0, 0, RELOC_CHECK_WARN },
+  { BFD_RELOC_24,	   3,  0, 0, RELOC_CHECK_WARN },
+  { BFD_RELOC_32,	   4,  0, 0, RELOC_CHECK_WARN },
+  { BFD_RELOC_8_PCREL,	   1,  0, 0, RELOC_CHECK_SIGNED },
+  { BFD_RELOC_Z80_DISP8,   1,  0, 0, RELOC_CHECK_SIGNED },
+  { BFD_RELOC_Z80_BYTE0,   1,  0, 0, RELOC_CHECK_NONE },
+  { BFD_RELOC_Z80_BYTE1,   1,  8, 0, RELOC_CHECK_NONE },
+  { BFD_RELOC_Z80_BYTE2,   1, 16, 0, RELOC_CHECK_NONE },
+  { BFD_RELOC_Z80_BYTE3,   1, 24, 0, RELOC_CHECK_NONE },
+  { BFD_RELOC_Z80_WORD0,   2,  0, 0, RELOC_CHECK_NONE },
+  { BFD_RELOC_Z80_WORD1,   2, 16, 0, RELOC_CHECK_NONE },
+  { BFD_RELOC_Z80_16_BE,   2,  0, 1, RELOC_CHECK_GENERIC },
+};
+
+static const struct reloc_desc *
+get_reloc_desc (bfd_reloc_code_real_type type)
+{
+  unsigned i;
+
+  for (i = 0; i < ARRAY_SIZE (reloc_desc_table); ++i)
+    if (reloc_desc_table[i].type == type)
+      return &reloc_desc_table[i];
+  return NULL;
+}
+
 void
 md_apply_fix (fixS * fixP, valueT* valP, segT seg)
 {
   long val = *valP;
   char *p_lit = fixP->fx_where + fixP->fx_frag->fr_literal;
+  const struct reloc_desc *desc = get_reloc_desc (fixP->fx_r_type);
 
+  ++stat_counts[STAT_APPLY_FIX];
   if (fixP->fx_addsy == NULL)
     fixP->fx_done = 1;
   else if (fixP->fx_pcrel)
@@ -4941,143 +8337,43 @@ md_apply_fix (fixS * fixP, valueT* valP, segT seg)
 	}
     }
 
-  set_overflow_flag(fixP);
-  apply_relocation(fixP, p_lit, val);
+  fixP->fx_no_overflow = desc == NULL || desc->check == RELOC_CHECK_NONE;
+  apply_relocation (fixP, desc, p_lit, val);
 }
 
+/* Store VAL at P_LIT as described by DESC, the descriptor of the
+   relocation type of FIXP.  */
 static void
-set_overflow_flag(fixS *fixP)
-{
-  switch (fixP->fx_r_type)
-    {
-    case BFD_RELOC_8_PCREL:
-    case BFD_RELOC_Z80_DISP8:
-    case BFD_RELOC_8:
-    case BFD_RELOC_16:
-    case BFD_RELOC_24:
-    case BFD_RELOC_32:
-    case BFD_RELOC_Z80_16_BE:
-      fixP->fx_no_overflow = 0;
-      break;
-    default:
-      fixP->fx_no_overflow = 1;
-      break;
-    }
-}
-
-static void
-write_byte(char **p_lit, long val)
-{
-  *(*p_lit)++ = val;
-}
-
-static void
-write_word_le(char **p_lit, long val)
-{
-  write_byte(p_lit, val);
-  write_byte(p_lit, val >> 8);
-}
-
-static void
-write_word_be(char **p_lit, long val)
-{
-  write_byte(p_lit, val >> 8);
-  write_byte(p_lit, val);
-}
-
-static void
-write_24bit_le(char **p_lit, long val)
-{
-  write_word_le(p_lit, val);
-  write_byte(p_lit, val >> 16);
-}
-
-static void
-write_32bit_le(char **p_lit, long val)
-{
-  write_word_le(p_lit, val);
-  write_word_le(p_lit, val >> 16);
-}
-
-static void
-check_overflow_and_warn(fixS *fixP, long val, int bits)
-{
-  if (fixP->fx_done && is_overflow(val, bits))
-    as_warn_where (fixP->fx_file, fixP->fx_line,
-                   _("%d-bit overflow (%+ld)"), bits, val);
-}
-
-static void
-check_signed_overflow(fixS *fixP, long val)
-{
-  if (fixP->fx_done && signed_overflow (val, 8))
-    as_bad_where (fixP->fx_file, fixP->fx_line,
-                  _("8-bit signed offset out of range (%+ld)"), val);
-}
-
-static void
-apply_relocation(fixS *fixP, char *p_lit, long val)
+apply_relocation (fixS *fixP, const struct reloc_desc *desc, char *p_lit,
+		  long val)
 {
-  switch (fixP->fx_r_type)
+  if (desc == NULL)
     {
-    case BFD_RELOC_8_PCREL:
-    case BFD_RELOC_Z80_DISP8:
-      check_signed_overflow(fixP, val);
-      write_byte(&p_lit, val);
-      break;
-
-    case BFD_RELOC_Z80_BYTE0:
-      write_byte(&p_lit, val);
-      break;
-
-    case BFD_RELOC_Z80_BYTE1:
-      write_byte(&p_lit, val >> 8);
-      break;
-
-    case BFD_RELOC_Z80_BYTE2:
-      write_byte(&p_lit, val >> 16);
-      break;
-
-    case BFD_RELOC_Z80_BYTE3:
-      write_byte(&p_lit, val >> 24);
-      break;
-
-    case BFD_RELOC_8:
-      check_overflow_and_warn(fixP, val, 8);
-      write_byte(&p_lit, val);
-      break;
-
-    case BFD_RELOC_Z80_WORD1:
-      write_word_le(&p_lit, val >> 16);
-      break;
-
-    case BFD_RELOC_Z80_WORD0:
-      write_word_le(&p_lit, val);
-      break;
-
-    case BFD_RELOC_16:
-      check_overflow_and_warn(fixP, val, 16);
-      write_word_le(&p_lit, val);
-      break;
-
-    case BFD_RELOC_24:
-      check_overflow_and_warn(fixP, val, 24);
-      write_24bit_le(&p_lit, val);
-      break;
-
-    case BFD_RELOC_32:
-      check_overflow_and_warn(fixP, val, 32);
-      write_32bit_le(&p_lit, val);
-      break;
-
-    case BFD_RELOC_Z80_16_BE:
-      write_word_be(&p_lit, val);
-      break;
-
-    default:
       printf (_("md_apply_fix: unknown reloc type 0x%x\n"), fixP->fx_r_type);
       abort ();
     }
+
+  if (fixP->fx_done)
+    switch (desc->check)
+      {
+      case RELOC_CHECK_WARN:
+	if (is_overflow (val, desc->size * 8))
+	  as_warn_where (fixP->fx_file, fixP->fx_line,
+			 _("%d-bit overflow (%+ld)"), desc->size * 8, val);
+	break;
+      case RELOC_CHECK_SIGNED:
+	if (signed_overflow (val, 8))
+	  as_bad_where (fixP->fx_file, fixP->fx_line,
+			_("8-bit signed offset out of range (%+ld)"), val);
+	break;
+      default:
+	break;
+      }
+
+  if (desc->big_endian)
+    number_to_chars_bigendian (p_lit, val >> desc->shift, desc->size);
+  else
+    number_to_chars_littleendian (p_lit, val >> desc->shift, desc->size);
 }
 
 /* GAS will call this to generate a reloc.  GAS will pass the
@@ -5095,6 +8391,7 @@ tc_gen_reloc (asection *seg ATTRIBUTE_UNUSED , fixS *fixp)
 {
   arelent *reloc;
 
+  ++stat_counts[STAT_GEN_RELOC];
   if (fixp->fx_subsy != NULL)
     {
       as_bad_subtract (fixp);
@@ -5151,6 +8448,16 @@ z80_tc_label_is_local (const char *name)
 */
 #define EXP_MIN -0x10000
 #define EXP_MAX 0x10000
+
+/* What str_to_decimal_float found.  */
+enum float_kind
+{
+  FLOAT_INVALID,
+  FLOAT_FINITE,
+  FLOAT_NAN,
+  FLOAT_INF
+};
+
 static int parse_sign(char **p, bool *signP)
 {
     *signP = (**p == '-');
@@ -5159,23 +8466,19 @@ static int parse_sign(char **p, bool *signP)
     return 1;
 }
 
-static int parse_special_values(char *p, uint64_t *mantissaP, int *expP)
+static enum float_kind parse_special_values(char *p)
 {
     if (strncasecmp(p, "NaN", 3) == 0)
     {
-        *mantissaP = 0;
-        *expP = 0;
         input_line_pointer = p + 3;
-        return 1;
+        return FLOAT_NAN;
     }
     if (strncasecmp(p, "inf", 3) == 0)
     {
-        *mantissaP = 1ull << 63;
-        *expP = EXP_MAX;
         input_line_pointer = p + 3;
-        return 1;
+        return FLOAT_INF;
     }
-    return 0;
+    return FLOAT_INVALID;
 }
 
 static void process_digits(char **p, uint64_t *mantissa, int *exponent, int *decrement_exp)
@@ -5240,40 +8543,90 @@ static void parse_exponent_part(char **p, int *exponent)
     *exponent += es ? -t : t;
 }
 
-static void normalize_mantissa(uint64_t *mantissa, int *exponent)
+/* Powers of ten 10^(2^k) and 10^-(2^k) as a 64-bit normalized mantissa
+   M and binary exponent E, the value being M / 2^64 * 2^E.  */
+static const struct
 {
-    for (; *mantissa <= ~0ull/10; --(*exponent))
-        *mantissa *= 10;
-}
+  uint64_t mantissa;
+  int exp;
+  uint64_t inv_mantissa;
+  int inv_exp;
+} pow10_table[] =
+{
+  { 0xa000000000000000ull,     4, 0xcccccccccccccccdull,    -3 }, /* 1e1 */
+  { 0xc800000000000000ull,     7, 0xa3d70a3d70a3d70aull,    -6 }, /* 1e2 */
+  { 0x9c40000000000000ull,    14, 0xd1b71758e219652cull,   -13 }, /* 1e4 */
+  { 0xbebc200000000000ull,    27, 0xabcc77118461cefdull,   -26 }, /* 1e8 */
+  { 0x8e1bc9bf04000000ull,    54, 0xe69594bec44de15bull,   -53 }, /* 1e16 */
+  { 0x9dc5ada82b70b59eull,   107, 0xcfb11ead453994baull,  -106 }, /* 1e32 */
+  { 0xc2781f49ffcfa6d5ull,   213, 0xa87fea27a539e9a5ull,  -212 }, /* 1e64 */
+  { 0x93ba47c980e98ce0ull,   426, 0xddd0467c64bce4a1ull,  -425 }, /* 1e128 */
+  { 0xaa7eebfb9df9de8eull,   851, 0xc0314325637a193aull,  -850 }, /* 1e256 */
+};
 
-static void convert_to_binary_exponent(uint64_t *mantissa, int *exponent, int *binary_exp)
+/* Multiply two normalized mantissas and return the normalized,
+   rounded upper half of the product; *EXPP is adjusted if the product
+   needed a normalizing shift.  */
+static uint64_t mul_mantissa(uint64_t a, uint64_t b, int *expP)
 {
-    #define BASE_BINARY_EXPONENT 64
-    
-    *binary_exp = BASE_BINARY_EXPONENT;
-    
-    for (; *exponent > 0; --(*exponent))
+    uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+    uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+    uint64_t ll = a_lo * b_lo;
+    uint64_t lh = a_lo * b_hi;
+    uint64_t hl = a_hi * b_lo;
+    uint64_t hh = a_hi * b_hi;
+    uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+    uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    uint64_t lo = (mid << 32) | (ll & 0xffffffff);
+
+    if (!(hi >> 63))
     {
-        while (*mantissa > ~0ull/10)
-        {
-            *mantissa >>= 1;
-            (*binary_exp)++;
-        }
-        *mantissa *= 10;
+        hi = (hi << 1) | (lo >> 63);
+        lo <<= 1;
+        --(*expP);
     }
-    
-    for (; *exponent < 0; ++(*exponent))
+    if ((lo >> 63) && ++hi == 0)
     {
-        while (!(*mantissa >> 63))
-        {
-            *mantissa <<= 1;
-            (*binary_exp)--;
-        }
-        *mantissa /= 10;
+        hi = 1ull << 63;
+        ++(*expP);
     }
-    
+    return hi;
+}
+
+/* Convert MANTISSA * 10^EXP10 to a normalized mantissa and binary
+   exponent, using at most one multiplication per bit of EXP10.  */
+static void decimal_to_binary(uint64_t *mantissa, int exp10, int *binary_exp)
+{
+    unsigned k;
+    unsigned e = exp10 < 0 ? -exp10 : exp10;
+
+    *binary_exp = 64;
     for (; !(*mantissa >> 63); --(*binary_exp))
         *mantissa <<= 1;
+
+    if (e >= 2u << (ARRAY_SIZE(pow10_table) - 1))
+    {
+        *mantissa = 1ull << 63;
+        *binary_exp = exp10 < 0 ? EXP_MIN : EXP_MAX;
+        return;
+    }
+
+    for (k = 0; e != 0; ++k, e >>= 1)
+        if (e & 1)
+        {
+            if (exp10 < 0)
+            {
+                *mantissa = mul_mantissa(*mantissa, pow10_table[k].inv_mantissa,
+                                         binary_exp);
+                *binary_exp += pow10_table[k].inv_exp;
+            }
+            else
+            {
+                *mantissa = mul_mantissa(*mantissa, pow10_table[k].mantissa,
+                                         binary_exp);
+                *binary_exp += pow10_table[k].exp;
+            }
+        }
 }
 
 static int handle_zero_mantissa(uint64_t mantissa, uint64_t *mantissaP, int *expP)
@@ -5287,16 +8640,19 @@ static int handle_zero_mantissa(uint64_t mantissa, uint64_t *mantissaP, int *exp
     return 0;
 }
 
-static int str_to_broken_float(bool *signP, uint64_t *mantissaP, int *expP)
+/* Parse a decimal number into MANTISSA * 10^EXP10.  */
+static enum float_kind str_to_decimal_float(bool *signP, uint64_t *mantissaP, int *exp10P)
 {
     char *p = (char*)skip_space(input_line_pointer);
     uint64_t mantissa = 0;
     int exponent = 0;
+    enum float_kind kind;
     
     parse_sign(&p, signP);
     
-    if (parse_special_values(p, mantissaP, expP))
-        return 1;
+    kind = parse_special_values(p);
+    if (kind != FLOAT_INVALID)
+        return kind;
     
     int no_decrement = 0;
     process_digits(&p, &mantissa, &exponent, &no_decrement);
@@ -5306,20 +8662,40 @@ static int str_to_broken_float(bool *signP, uint64_t *mantissaP, int *expP)
     parse_exponent_part(&p, &exponent);
     
     if (ISALNUM(*p) || *p == '.')
-        return 0;
+        return FLOAT_INVALID;
         
     input_line_pointer = p;
+    *mantissaP = mantissa;
+    *exp10P = exponent;
+    return FLOAT_FINITE;
+}
+
+static int str_to_broken_float(bool *signP, uint64_t *mantissaP, int *expP)
+{
+    uint64_t mantissa;
+    int exponent;
     
-    if (handle_zero_mantissa(mantissa, mantissaP, expP))
+    switch (str_to_decimal_float(signP, &mantissa, &exponent))
+    {
+    case FLOAT_INVALID:
+        return 0;
+    case FLOAT_NAN:
+        *mantissaP = 0;
+        *expP = 0;
         return 1;
+    case FLOAT_INF:
+        *mantissaP = 1ull << 63;
+        *expP = EXP_MAX;
+        return 1;
+    default:
+        break;
+    }
     
-    normalize_mantissa(&mantissa, &exponent);
-    
-    int binary_exp;
-    convert_to_binary_exponent(&mantissa, &exponent, &binary_exp);
+    if (handle_zero_mantissa(mantissa, mantissaP, expP))
+        return 1;
     
+    decimal_to_binary(&mantissa, exponent, expP);
     *mantissaP = mantissa;
-    *expP = binary_exp;
     return 1;
 }
 
@@ -5495,6 +8871,142 @@ static void write_float48_bytes(char *litP, int biased_exponent, uint64_t mantis
     }
 }
 
+/*
+  Microsoft Binary Format, as used by MSX-BASIC and other Microsoft
+  BASIC interpreters.  Layout (little endian):
+  mantissa bytes, lowest first; bit 7 of the last one is the sign, the
+  leading mantissa bit is implied;
+  last byte: exponent+128 (0 - value is null)
+  The 32 bit variant has a 24 bit mantissa, the 40 bit one 32 bits.
+*/
+static const char *
+str_to_mbf (char *litP, int *sizeP, int mantissa_bits)
+{
+  const int EXPONENT_BIAS = 0x80;
+  int mantissa_bytes = mantissa_bits / 8;
+  uint64_t mantissa;
+  bool sign;
+  int exponent;
+  int i;
+
+  *sizeP = mantissa_bytes + 1;
+
+  if (!str_to_broken_float (&sign, &mantissa, &exponent))
+    return _("invalid syntax");
+
+  if (mantissa == 0)
+    return _("NaN is not supported");
+
+  mantissa = ((mantissa >> (63 - mantissa_bits)) + 1) >> 1;
+  if (mantissa >> mantissa_bits)
+    {
+      mantissa >>= 1;
+      ++exponent;
+    }
+
+  if (exponent + EXPONENT_BIAS <= 0)
+    {
+      memset (litP, 0, *sizeP);
+      return NULL;
+    }
+
+  if (exponent + EXPONENT_BIAS > 0xFF)
+    return _("overflow");
+
+  mantissa &= (1ull << (mantissa_bits - 1)) - 1;
+  if (sign)
+    mantissa |= 1ull << (mantissa_bits - 1);
+
+  for (i = 0; i < mantissa_bytes; i++)
+    {
+      *litP++ = mantissa & 0xFF;
+      mantissa >>= 8;
+    }
+  *litP = exponent + EXPONENT_BIAS;
+
+  return NULL;
+}
+
+static const char *
+str_to_mbf32 (char *litP, int *sizeP)
+{
+  return str_to_mbf (litP, sizeP, 24);
+}
+
+static const char *
+str_to_mbf40 (char *litP, int *sizeP)
+{
+  return str_to_mbf (litP, sizeP, 32);
+}
+
+/*
+  TI-83/TI-84 Plus real number, 9 bytes:
+  byte 0: 0x80 for negative numbers, 0x00 otherwise
+  byte 1: decimal exponent+128 (value is d.ddd...*10^exp)
+  byte 2-8: 14 BCD digits, most significant first
+  MIN: 1e-99
+  MAX: 9.9999999999999e+99
+*/
+#define TI_BCD_SIZE 9
+#define TI_BCD_DIGITS 14
+#define TI_BCD_EXP_MAX 99
+static const char *
+str_to_ti_bcd (char *litP, int *sizeP)
+{
+  char digits[24];
+  uint64_t mantissa;
+  bool sign;
+  int exponent;
+  int n, i;
+
+  *sizeP = TI_BCD_SIZE;
+
+  switch (str_to_decimal_float (&sign, &mantissa, &exponent))
+    {
+    case FLOAT_FINITE:
+      break;
+    case FLOAT_INVALID:
+      return _("invalid syntax");
+    default:
+      return _("NaN and infinity are not supported");
+    }
+
+  memset (litP, 0, TI_BCD_SIZE);
+  litP[1] = (char) 0x80;
+  if (mantissa == 0)
+    return NULL;
+
+  n = sprintf (digits, "%" PRIu64, mantissa);
+  exponent += n - 1;
+  memset (digits + n, '0', sizeof (digits) - n);
+
+  /* Round half up to TI_BCD_DIGITS digits.  */
+  if (n > TI_BCD_DIGITS && digits[TI_BCD_DIGITS] >= '5')
+    {
+      for (i = TI_BCD_DIGITS - 1; i >= 0 && digits[i] == '9'; --i)
+	digits[i] = '0';
+      if (i >= 0)
+	++digits[i];
+      else
+	{
+	  digits[0] = '1';
+	  ++exponent;
+	}
+    }
+
+  if (exponent < -TI_BCD_EXP_MAX)
+    return NULL;
+  if (exponent > TI_BCD_EXP_MAX)
+    return _("overflow");
+
+  litP[0] = sign ? (char) 0x80 : 0x00;
+  litP[1] = 0x80 + exponent;
+  for (i = 0; i < TI_BCD_DIGITS; i += 2)
+    litP[2 + i / 2] = ((digits[i] - '0') << 4) | (digits[i + 1] - '0');
+
+  return NULL;
+}
+
 static const char *
 str_to_ieee754_h(char *litP, int *sizeP)
 {